@@ -4,6 +4,7 @@
 //  Parallelized Burrows Wheeler transform applicable to general data based on Mark Nelson's 1996 code
 //
 
+#define _GNU_SOURCE // qsort_r
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -17,19 +18,53 @@
 #endif
 #include <math.h>
 #include <limits.h>
+#include "sais.h"
 
 //#define BLOCK_SIZE 20000
 //#define NUM_THREADS 16 
 #define MAX_THREADS 8
 
+// suffix sorting engines selectable with -e
+#define ENGINE_QSORT 0 // qsort() with bounded_compare(), original implementation
+#define ENGINE_SAIS 1  // linear time induced sorting, independent of input repetitiveness
+#define ENGINE_PSORT 2 // buckets on the two leading bytes, sorted by several threads per block
+
+// buckets of the parallel sort: two leading symbols, each a byte or the end of buffer (256)
+#define NBUCKETS (257 * 257)
+// psort hands a block to SA-IS when one bucket holds more than 1/PSORT_MAX_BUCKET of its
+// suffixes, or two suffixes agree on PSORT_MAX_DEPTH bytes: such buckets (runs, periodic
+// or repeated data) take quadratic time with comparison sorting
+#define PSORT_MAX_BUCKET 4
+#define PSORT_MAX_DEPTH 1024
+
 // Structure to hold block data
 typedef struct {
     unsigned char *buff; // len BLOCK_SIZE
     size_t size;
 		int bnum;
 		int *inds; // len BLOCK_SIZE + 1
+		int sort_threads; // threads used to sort this block with ENGINE_PSORT
+		int busy; // slot holds a block that is not written yet
+		size_t out_offset; // position of the block record in the output file
 } BlockData;
 
+// Shared state of the threads sorting one block with ENGINE_PSORT
+typedef struct {
+    BlockData *bdata;
+    int nthr;
+    int *offsets;       // nthr x NBUCKETS, key counts per thread then scatter positions
+    int *bucket_start;  // NBUCKETS + 1 bucket boundaries in inds
+    int next_bucket;    // next bucket to sort, taken under lock
+    int too_deep;       // two suffixes agree on PSORT_MAX_DEPTH bytes, atomic
+    pthread_mutex_t lock;
+} ParallelSort;
+
+typedef struct {
+    ParallelSort *ps;
+    int tid;
+    int phase;
+} ParallelSortArg;
+
 
 //
 // length has the number of bytes presently read into the buffer,
@@ -42,10 +77,42 @@ long length;
 pthread_key_t buffer_key;
 
 int memcmp_signed;
-
-int active_threads = 0;
-pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
+int sort_engine = ENGINE_SAIS;
+
+// Shared state of the read -> sort -> write pipeline. The main thread reads block b into
+// slot b % queue_nslots, workers sort the blocks in read order and write each one at its
+// precomputed offset in the output, which frees the slot for the reader.
+BlockData *queue_blocks;
+int queue_nslots = 1;
+int queue_nblocks = 0;   // blocks in the input
+int queue_nread = 0;     // blocks read so far
+int queue_next = 0;      // next block to sort
+int queue_nthreads = 1;
+int queue_sorting = 0;   // threads sorting blocks taken by the workers, helpers included
+int reading_done = 0;
 pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t thread_cond = PTHREAD_COND_INITIALIZER;
+
+// BWT output file and the first/last rows of every block for the block log
+int out_fd;
+long *block_first, *block_last;
+
+// With -k, every record also stores the rows of nsamples evenly spaced positions of the
+// block, so that the inverse BWT of one block can be split in nsamples + 1 walks. Such a
+// record starts with the negated length, then nsamples and (position, row) pairs.
+long nsamples = 0;
+
+// With -H, the byte histogram of every block record goes to a sidecar file, so that the
+// megablock clustering needs not read the BWT output again: the magic, the number of
+// blocks, then one HistRecord per block at HIST_HEADER + (bnum - 1) * sizeof(HistRecord).
+#define HIST_MAGIC "PBWTHIST"
+#define HIST_HEADER (8 + sizeof(long))
+typedef struct {
+    long offset;              // position of the record in the output file
+    long length;              // record size
+    unsigned int hist[256];   // byte counts of the record
+} HistRecord;
+int hist_fd = -1;
 
 /* The function iterates through the memory blocks one byte at a time. It compares the corresponding bytes from each block until it finds a mismatch or reaches the end of the blocks.
  * It casts the pointers to unsigned char*, meaning each byte is treated as an unsigned character. This is crucial for binary data, where the sign of the byte should not influence the comparison.
@@ -174,8 +241,175 @@ int bounded_compare1(const unsigned int *i1, const unsigned int *i2)
 }
 
 
-void *process_block(void *arg) {
-    BlockData *bdata = (BlockData *)arg;
+/* Key of the bucket holding suffix i: its two leading symbols, where the end of the buffer
+ * is symbol 256 so that it sorts after every byte as in bounded_compare(). */
+static inline int suffix_key(const unsigned char *b, long n, long i) {
+    int c0 = (i < n) ? b[i] : 256;
+    int c1 = (i + 1 < n) ? b[i + 1] : 256;
+    return c0 * 257 + c1;
+}
+
+
+/* bounded_compare() for two suffixes of the same bucket, which share their first two bytes.
+ * The sort is passed as context so no thread-specific lookup is needed. Past PSORT_MAX_DEPTH
+ * equal bytes it sets too_deep, after which every comparison returns at once and the
+ * block is sorted again with SA-IS. */
+int bucket_compare(const void *p1, const void *p2, void *arg) {
+    ParallelSort *ps = (ParallelSort *)arg;
+    BlockData *bdata = ps->bdata;
+    unsigned int i1 = *(const unsigned int *)p1, i2 = *(const unsigned int *)p2;
+    unsigned int l1 = (unsigned int)(bdata->size - i1);
+    unsigned int l2 = (unsigned int)(bdata->size - i2);
+    unsigned int min_length = (l1 < l2) ? l1 : l2;
+    unsigned int depth = (min_length - 2 < PSORT_MAX_DEPTH) ? min_length - 2 : PSORT_MAX_DEPTH;
+    int result;
+
+    if (__atomic_load_n(&ps->too_deep, __ATOMIC_RELAXED))
+        return 0;
+    result = memcmp(bdata->buff + i1 + 2, bdata->buff + i2 + 2, depth);
+    if ( result == 0 && depth < min_length - 2 ) {
+        __atomic_store_n(&ps->too_deep, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if ( result == 0 )
+        return l2 - l1;
+    return result;
+}
+
+
+/* One thread of the parallel sort. Phase 0 counts bucket keys of the thread's share of the
+ * suffixes, phase 1 scatters them to their buckets and phase 2 sorts whole buckets taken
+ * from the shared counter until none are left. */
+void *psort_thread(void *arg) {
+    ParallelSortArg *parg = (ParallelSortArg *)arg;
+    ParallelSort *ps = parg->ps;
+    BlockData *bdata = ps->bdata;
+    long n = bdata->size, i;
+    long lo = (n + 1) * parg->tid / ps->nthr;
+    long hi = (n + 1) * (parg->tid + 1) / ps->nthr;
+    int *offsets = ps->offsets + (size_t)parg->tid * NBUCKETS;
+    int b, first_bucket, last_bucket;
+
+    if (parg->phase == 0) {
+        for (i = lo; i < hi; i++)
+            offsets[suffix_key(bdata->buff, n, i)]++;
+    } else if (parg->phase == 1) {
+        for (i = lo; i < hi; i++)
+            bdata->inds[offsets[suffix_key(bdata->buff, n, i)]++] = (int)i;
+    } else {
+        for (;;) {
+            pthread_mutex_lock(&ps->lock);
+            first_bucket = ps->next_bucket;
+            // take small groups of buckets, most of them are tiny or empty
+            last_bucket = first_bucket + 64;
+            if (last_bucket > NBUCKETS)
+                last_bucket = NBUCKETS;
+            ps->next_bucket = last_bucket;
+            pthread_mutex_unlock(&ps->lock);
+            if (first_bucket >= NBUCKETS)
+                break;
+
+            for (b = first_bucket; b < last_bucket && !__atomic_load_n(&ps->too_deep, __ATOMIC_RELAXED); b++) {
+                int size = ps->bucket_start[b + 1] - ps->bucket_start[b];
+                // buckets holding the end of the buffer have a single suffix
+                if (size > 1 && b / 257 != 256 && b % 257 != 256)
+                    qsort_r(bdata->inds + ps->bucket_start[b], size, sizeof(int),
+                            bucket_compare, ps);
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/* Runs one phase of the parallel sort on ps->nthr threads. */
+int psort_run_phase(ParallelSort *ps, ParallelSortArg *args, pthread_t *threads, int phase) {
+    int t;
+
+    for (t = 0; t < ps->nthr; t++) {
+        args[t].ps = ps;
+        args[t].tid = t;
+        args[t].phase = phase;
+        if (pthread_create(&threads[t], NULL, psort_thread, &args[t]))
+            return -1;
+    }
+    for (t = 0; t < ps->nthr; t++)
+        pthread_join(threads[t], NULL);
+    return 0;
+}
+
+
+/* Sorts the rotations of one block with several threads: the suffixes are distributed to
+ * buckets on their two leading bytes by a parallel counting sort, then the buckets are
+ * sorted concurrently. Gives the same order as qsort() with bounded_compare(). A block
+ * with a dominant bucket or long repeats is sorted with SA-IS instead (same order). */
+int parallel_sort_block(BlockData *bdata, int nthr) {
+    ParallelSort ps;
+    ParallelSortArg *args;
+    pthread_t *threads;
+    int b, t, pos, size, max_size = 0, rc = 0;
+
+    if (nthr < 1)
+        nthr = 1;
+    ps.bdata = bdata;
+    ps.nthr = nthr;
+    ps.next_bucket = 0;
+    ps.too_deep = 0;
+    ps.offsets = (int *)calloc((size_t)nthr * NBUCKETS, sizeof(int));
+    ps.bucket_start = (int *)malloc((NBUCKETS + 1) * sizeof(int));
+    args = (ParallelSortArg *)malloc(nthr * sizeof(ParallelSortArg));
+    threads = (pthread_t *)malloc(nthr * sizeof(pthread_t));
+    pthread_mutex_init(&ps.lock, NULL);
+    if (!ps.offsets || !ps.bucket_start || !args || !threads) {
+        rc = -1;
+        goto done;
+    }
+
+    if (psort_run_phase(&ps, args, threads, 0)) {
+        rc = -1;
+        goto done;
+    }
+
+    // turn the per thread counts into scatter positions, keeping suffixes in index order
+    for (pos = 0, b = 0; b < NBUCKETS; b++) {
+        ps.bucket_start[b] = pos;
+        for (t = 0; t < nthr; t++) {
+            int count = ps.offsets[(size_t)t * NBUCKETS + b];
+            ps.offsets[(size_t)t * NBUCKETS + b] = pos;
+            pos += count;
+        }
+        size = pos - ps.bucket_start[b];
+        if (size > max_size)
+            max_size = size;
+    }
+    ps.bucket_start[NBUCKETS] = pos;
+
+    if (max_size > 1 && max_size > ((long)bdata->size + 1) / PSORT_MAX_BUCKET) {
+        printf("Block num: %d, a bucket holds %d of %ld suffixes, sorting with SA-IS\n",
+               bdata->bnum, max_size, (long)bdata->size + 1);
+        rc = sais_bwt_order(bdata->buff, bdata->inds, (int)bdata->size) ? -1 : 0;
+        goto done;
+    }
+
+    if (psort_run_phase(&ps, args, threads, 1) || psort_run_phase(&ps, args, threads, 2))
+        rc = -1;
+    else if (ps.too_deep) {
+        printf("Block num: %d, repeats longer than %d bytes, sorting with SA-IS\n",
+               bdata->bnum, PSORT_MAX_DEPTH);
+        rc = sais_bwt_order(bdata->buff, bdata->inds, (int)bdata->size) ? -1 : 0;
+    }
+
+done:
+    pthread_mutex_destroy(&ps.lock);
+    free(ps.offsets);
+    free(ps.bucket_start);
+    free(args);
+    free(threads);
+    return rc;
+}
+
+
+void process_block(BlockData *bdata) {
     int i; long len; // do not use globals to avoid race conditions
 
     // Associate the local buffer with the key for this thread
@@ -186,18 +420,205 @@ void *process_block(void *arg) {
     // init indices and sort with current block data
     len = bdata->size;
     printf("Block num: %d, length = %ld\n", bdata->bnum, len);
-    for (i = 0 ; i <= len ; i++){
-      bdata->inds[ i ] = i;
-    }
 
+    if (sort_engine == ENGINE_SAIS) {
+        // linear time suffix sort, gives the same order as bounded_compare
+        if (sais_bwt_order(bdata->buff, bdata->inds, (int)len)) {
+            fprintf(stderr, "Error sorting block %d\n", bdata->bnum);
+            exit(1);
+        }
+    } else if (sort_engine == ENGINE_PSORT) {
+        printf("Block num: %d, sorting with %d threads\n", bdata->bnum, bdata->sort_threads);
+        if (parallel_sort_block(bdata, bdata->sort_threads)) {
+            fprintf(stderr, "Error sorting block %d\n", bdata->bnum);
+            exit(1);
+        }
+    } else {
+        for (i = 0 ; i <= len ; i++){
+          bdata->inds[ i ] = i;
+        }
 		// perform sort with custom compare function
 		qsort( bdata->inds,
                (int)( len + 1 ),
                sizeof( int ),
                ( int (*)(const void *, const void *) ) bounded_compare );
+    }
         fprintf( stderr, "\n" );
+}
+
 
-    pthread_exit(NULL);
+/* Size of the output record of a block of n bytes: its length, the n+1 characters of the
+ * last column and the first/last rows, plus the start samples with -k. */
+size_t block_record_size(size_t n) {
+    size_t samples = nsamples ? sizeof(long) + 2 * nsamples * sizeof(long) : 0;
+    return sizeof(long) + samples + (n + 1) + 2 * sizeof(long);
+}
+
+
+/* Gathers the last column of the sorted rotations of a block into its output record and
+ * writes the record at the block's precomputed offset. The record is built in place over
+ * the index array: character i only overwrites bytes of indices that were already read,
+ * so the block data and the index memory beyond the record are released before writing. */
+int write_block(BlockData *bdata) {
+    long i, l, first = 0, last = 0, m, p, step, header;
+    size_t rsize = block_record_size(bdata->size);
+    unsigned char *record = (unsigned char*)bdata->inds;
+    unsigned char *shrunk;
+    long *samples = NULL;
+    HistRecord hrec;
+    ssize_t rc;
+    size_t written;
+
+    // sample m is position m * step of the block, with the row i where inds[i] == p + 1,
+    // from where the forward walk produces the block from position p on
+    l = bdata->size + 1;
+    step = (bdata->size + nsamples) / (nsamples + 1);
+    if (step < 1)
+        step = 1;
+    if (hist_fd >= 0)
+        memset(&hrec, 0, sizeof(hrec));
+    if (nsamples) {
+        samples = (long*)malloc(2 * nsamples * sizeof(long));
+        if (samples == NULL)
+            return -1;
+        for (m = 0; m < nsamples; m++) {
+            samples[2 * m] = bdata->size; // past the end of a small block: the end marker row
+            samples[2 * m + 1] = -1;
+        }
+    }
+    for ( i = 0 ; i < l ; i++ ) {
+        int ind = bdata->inds[i];
+        if (nsamples) {
+            p = (ind == 0) ? (long)bdata->size : ind - 1;
+            m = p / step;
+            if (p == m * step && m >= 1 && m <= nsamples) {
+                samples[2 * (m - 1)] = p;
+                samples[2 * (m - 1) + 1] = i;
+            }
+        }
+        if ( ind == 1 )
+            first = i;
+        if ( ind == 0 ) {
+            last = i;
+            record[i] = '?';
+        } else{
+            record[i] = bdata->buff[ ind - 1 ];
+        }
+        // counted here, every byte of the last column passes through once
+        if (hist_fd >= 0)
+            hrec.hist[record[i]]++;
+    }
+    free(bdata->buff);
+    bdata->buff = NULL;
+    fprintf( stderr,
+        "first = %ld"
+        "  last = %ld\n",
+        first,
+        last );
+
+    // make room for the length (and samples) in front of the last column
+    header = rsize - l - 2 * sizeof(long);
+    memmove(record + header, record, l);
+    if (nsamples) {
+        for (m = 0; m < nsamples; m++)
+            if (samples[2 * m + 1] < 0)
+                samples[2 * m + 1] = last;
+        i = -l;
+        memcpy(record, &i, sizeof(long));
+        memcpy(record + sizeof(long), &nsamples, sizeof(long));
+        memcpy(record + 2 * sizeof(long), samples, 2 * nsamples * sizeof(long));
+        free(samples);
+    } else {
+        memcpy(record, &l, sizeof(long));
+    }
+    memcpy(record + header + l, &first, sizeof(long));
+    memcpy(record + header + l + sizeof(long), &last, sizeof(long));
+    block_first[bdata->bnum - 1] = first;
+    block_last[bdata->bnum - 1] = last;
+
+    // the histogram covers the whole record: add the length, samples and first/last bytes
+    if (hist_fd >= 0) {
+        for (i = 0; i < header; i++)
+            hrec.hist[record[i]]++;
+        for (i = header + l; i < (long)rsize; i++)
+            hrec.hist[record[i]]++;
+        hrec.offset = (long)bdata->out_offset;
+        hrec.length = (long)rsize;
+        if (pwrite(hist_fd, &hrec, sizeof(hrec), HIST_HEADER + (bdata->bnum - 1) * sizeof(hrec)) != sizeof(hrec))
+            return -1;
+    }
+
+    // drop the index memory past the record, about 3/4 of it
+    shrunk = (unsigned char*)realloc(record, rsize);
+    if (shrunk != NULL)
+        record = shrunk;
+    bdata->inds = (int*)record;
+
+    for (written = 0; written < rsize; written += rc) {
+        rc = pwrite(out_fd, record + written, rsize - written, bdata->out_offset + written);
+        if (rc <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+/* Worker of the BWT thread pool: keeps pulling the next block read by the main thread until
+ * the input is exhausted, and writes each sorted block straight to its place in the output. */
+void *bwt_worker(void *arg) {
+    BlockData *bdata;
+    int b, blocks_left, idle;
+
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&thread_mutex);
+        while (queue_next >= queue_nread && !reading_done)
+            pthread_cond_wait(&thread_cond, &thread_mutex);
+        if (queue_next >= queue_nread) {
+            pthread_mutex_unlock(&thread_mutex);
+            break;
+        }
+        b = queue_next++;
+        bdata = &queue_blocks[b % queue_nslots];
+        blocks_left = (queue_nblocks > b) ? queue_nblocks - b : 1;
+        // once fewer blocks than idle threads are left, the remaining blocks share them;
+        // the threads still sorting earlier blocks are not idle
+        idle = queue_nthreads - queue_sorting;
+        bdata->sort_threads = (blocks_left < idle) ? idle / blocks_left : 1;
+        queue_sorting += bdata->sort_threads;
+        pthread_mutex_unlock(&thread_mutex);
+        // The +1 accounts for the extra index needed to represent the virtual end-of-buffer character,
+        // tiny blocks get enough room for their output record which is built over the indices
+        size_t inds_bytes = (bdata->size+1)*sizeof(int);
+        if (inds_bytes < block_record_size(bdata->size))
+            inds_bytes = block_record_size(bdata->size);
+        bdata->inds = (int*)malloc(inds_bytes);
+        if (bdata->inds == NULL) {
+            fprintf(stderr, "Error allocating indices for block %d\n", bdata->bnum);
+            exit(1);
+        }
+        fprintf( stderr, "Performing BWT on %ld bytes (block # %d) with thread\n", bdata->size, bdata->bnum);
+        process_block(bdata);
+        if (write_block(bdata)) {
+            fprintf(stderr, "Error writing block %d\n", bdata->bnum);
+            exit(1);
+        }
+        free(bdata->inds);
+
+        pthread_mutex_lock(&thread_mutex);
+        queue_sorting -= bdata->sort_threads;
+        bdata->busy = 0;
+        pthread_cond_broadcast(&thread_cond);
+        pthread_mutex_unlock(&thread_mutex);
+    }
+    return NULL;
+}
+
+
+/* Number of worker threads to use when -t is not given. */
+int detect_nthreads(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return (ncpu > 0) ? (int)ncpu : MAX_THREADS;
 }
 
 
@@ -235,36 +656,74 @@ size_t convert_to_bytes(const char *size_str) {
 
 int main( int argc, char *argv[] )
 {
-		if(argc != 4) {
-        fprintf(stderr, "Usage: %s input_file output_file block_size\n", argv[0]);
+    int opt;
+    int nthreads = 0, streaming = 0, low_memory = 0;
+    const char *hist_file = NULL;
+    while ((opt = getopt(argc, argv, "e:t:slk:H:")) != -1) {
+        switch (opt) {
+            case 'e':
+                if (strcmp(optarg, "sais") == 0)
+                    sort_engine = ENGINE_SAIS;
+                else if (strcmp(optarg, "qsort") == 0)
+                    sort_engine = ENGINE_QSORT;
+                else if (strcmp(optarg, "psort") == 0)
+                    sort_engine = ENGINE_PSORT;
+                else {
+                    fprintf(stderr, "Unknown sort engine: %s (use sais, psort or qsort)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 's':
+                streaming = 1;
+                break;
+            case 'l':
+                low_memory = 1;
+                break;
+            case 'k':
+                nsamples = atol(optarg);
+                if (nsamples < 0)
+                    nsamples = 0;
+                break;
+            case 'H':
+                hist_file = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-e sais|psort|qsort] [-t nthreads] [-s|-l] [-k nsamples] [-H histfile] input_file output_file block_size\n", argv[0]);
+                return 1;
+        }
+    }
+		if(argc - optind != 3) {
+        fprintf(stderr, "Usage: %s [-e sais|psort|qsort] [-t nthreads] [-s|-l] [-k nsamples] [-H histfile] input_file output_file block_size\n", argv[0]);
         return 1;
     }
 
     printf("starting up..\n");
 
-    char in_file[200], out_file[200], nthreads_str[20];
+    char in_file[200], out_file[200];
     unsigned char *buffer;
-    int i, nb, nblocks = 0, debug = 0, max_threads = 8;
-    long l, lSize, first, last, totsize = 0;
-    size_t current_offset = 0; // Track the current file position
-    size_t block_start, block_end; // Track the start and end bytes of each block
-
-    strcpy(in_file, argv[1]);
-    strcpy(out_file, argv[2]);
-    size_t BLOCK_SIZE = convert_to_bytes(argv[3]);
+    int i, nb, nblocks = 0;
+    long lSize;
+
+    strcpy(in_file, argv[optind]);
+    strcpy(out_file, argv[optind + 1]);
+    size_t BLOCK_SIZE = convert_to_bytes(argv[optind + 2]);
     printf("Size in bytes for block read: %zu\n", BLOCK_SIZE);
-    //strcpy(nthreads_str, argv[4]);
-    buffer = (unsigned char*)malloc(BLOCK_SIZE);
 
-    FILE *fp_in, *fp_out, *fp_log;
+    FILE *fp_in, *fp_log;
     printf("opening %s and %s\n", in_file, out_file);
     fp_in = fopen(in_file, "rb");
-    fp_out = fopen(out_file, "wb");
+    out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     fp_log = fopen("temp/bwt_log.txt", "w");
+    if (fp_in == NULL || out_fd < 0 || fp_log == NULL) {
+        fprintf(stderr, "Error opening %s, %s or temp/bwt_log.txt\n", in_file, out_file);
+        return 1;
+    }
 
 #if !defined( unix )
     setmode( fileno( fp_in ), O_BINARY );
-    setmode( fileno( fp_out ), O_BINARY );
 #endif
     /* In hexadecimal, \x070 is 0x70 and \x080 is 0x80. The result of this comparison tells you whether memcmp() is treating these bytes as signed or unsigned values.
     If it treats them as unsigned, \x080 (128 in decimal) is greater than \x070 (112 in decimal), so memcmp() will return a positive value.
@@ -291,94 +750,110 @@ int main( int argc, char *argv[] )
     nblocks = (int)((lSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
     printf("nblocks = %d\n", nblocks);
 
-    // Initialize variables
-    BlockData* blocks = (BlockData*)malloc((nblocks+1) * sizeof(BlockData)); // Array to hold block data
-
-
-    // Fill blocks array with input data
-        nblocks = 0;
-        for ( ; ; ) {
-            //length = fread( (char *) blocks[nblocks].buff, 1, BLOCK_SIZE, fp_in);
-            length = fread( buffer, 1, BLOCK_SIZE, fp_in);
-            if ( length == 0 )
-                break;
-            blocks[nblocks].size = length;
-            blocks[nblocks].buff = (unsigned char*)malloc(length*sizeof(unsigned char));
-            // The +1 accounts for the extra index needed to represent the virtual end-of-buffer character
-            blocks[nblocks].inds = (int*)malloc((length+1)*sizeof(int));
-            //strcpy(blocks[nblocks].buff, buffer);
-            memcpy(blocks[nblocks].buff, buffer, length); // Replaced strcpy with memcpy
-            nblocks++;
+    // Every block but the last is full, so all record offsets are known before sorting
+    size_t full_record = block_record_size(BLOCK_SIZE);
+    size_t out_size = (nblocks > 0) ? (nblocks - 1) * full_record
+                      + block_record_size(lSize - (size_t)(nblocks - 1) * BLOCK_SIZE) : 0;
+    if (ftruncate(out_fd, (off_t)out_size)) {
+        fprintf(stderr, "Error sizing %s\n", out_file);
+        return 1;
+    }
+    if (hist_file != NULL) {
+        long nb_long = nblocks;
+        hist_fd = open(hist_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (hist_fd < 0 || write(hist_fd, HIST_MAGIC, 8) != 8 ||
+            write(hist_fd, &nb_long, sizeof(long)) != sizeof(long)) {
+            fprintf(stderr, "Error writing %s\n", hist_file);
+            return 1;
         }
+    }
+    block_first = (long*)calloc(nblocks + 1, sizeof(long));
+    block_last = (long*)calloc(nblocks + 1, sizeof(long));
+
+    // With -s only a few blocks are in flight at a time, so memory is bounded by the
+    // number of threads times the block size instead of the input size. With -l there is
+    // no read ahead either: every block in memory is being sorted or written.
+    if (nthreads <= 0)
+        nthreads = detect_nthreads();
+    queue_nthreads = nthreads;
+    if (nthreads > nblocks)
+        nthreads = (nblocks > 0) ? nblocks : 1;
+    queue_nslots = low_memory ? nthreads : streaming ? nthreads + 1 : nblocks + 1;
+    printf("Using %d worker threads and %d block slots\n", nthreads, queue_nslots);
+
+    BlockData* blocks = (BlockData*)calloc(queue_nslots, sizeof(BlockData)); // Slots holding block data
+    queue_blocks = blocks;
+    queue_nblocks = nblocks;
+
+    // now peform BWT on the blocks with a fixed size pool of worker threads
+    pthread_t *threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    for(i = 0; i < nthreads; i++){
+        if (pthread_create(&threads[i], NULL, bwt_worker, NULL)){
+            fprintf(stderr, "Error creating thread\n"); return 1;
+        }
+    }
 
-        fclose(fp_in);
-        printf("Read data for %d blocks..\n", nblocks);
-        pthread_t threads[nblocks];
-
-        // now peform BWT on each block in parallel
-        for(nb = 0; nb < nblocks; nb++){
-            memcpy(buffer, blocks[nb].buff, blocks[nb].size);
-            length = blocks[nb].size;
-            blocks[nb].bnum = nb+1;
-
-            // Create the thread and pass the structure as an argument
-            fprintf( stderr, "Performing BWT on %ld bytes (block # %d) with thread\n", blocks[nb].size, blocks[nb].bnum);
-            if (pthread_create(&threads[nb], NULL, process_block, (void *)&blocks[nb])){
-                fprintf(stderr, "Error creating thread\n"); return 1;
-            }
-            if(nb > 0 && (nb % max_threads == 0)){
-                sleep(2);
-            }
+    // Feed the workers with input data, waiting for a free slot when all are in flight
+    for (nb = 0; nb < nblocks; nb++) {
+        pthread_mutex_lock(&thread_mutex);
+        while (blocks[nb % queue_nslots].busy)
+            pthread_cond_wait(&thread_cond, &thread_mutex);
+        pthread_mutex_unlock(&thread_mutex);
+
+        buffer = (unsigned char*)malloc(BLOCK_SIZE);
+        if (buffer == NULL) {
+            fprintf(stderr, "Error allocating block %d\n", nb + 1);
+            return 1;
+        }
+        length = fread( buffer, 1, BLOCK_SIZE, fp_in);
+        if ( length != (long)BLOCK_SIZE && nb != nblocks - 1 ) {
+            fprintf(stderr, "Short read in block %d of %s\n", nb + 1, in_file);
+            return 1;
         }
+        blocks[nb % queue_nslots].size = length;
+        blocks[nb % queue_nslots].buff = buffer;
+        blocks[nb % queue_nslots].bnum = nb+1;
+        blocks[nb % queue_nslots].busy = 1;
+        blocks[nb % queue_nslots].out_offset = nb * full_record;
+
+        pthread_mutex_lock(&thread_mutex);
+        queue_nread++;
+        pthread_cond_broadcast(&thread_cond);
+        pthread_mutex_unlock(&thread_mutex);
+    }
+    fclose(fp_in);
+    printf("Read data for %d blocks..\n", nb);
+
+    pthread_mutex_lock(&thread_mutex);
+    reading_done = 1;
+    pthread_cond_broadcast(&thread_cond);
+    pthread_mutex_unlock(&thread_mutex);
 
     // Wait for threads to finish, then delete key
-    for (nb = 0; nb < nblocks; nb++) {
-        pthread_join(threads[nb], NULL);
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
     }
+    free(threads);
+    free(blocks);
     pthread_key_delete(buffer_key);
 
-    // Write out the results
-    printf("Writing data to %s\n", out_file);
-    current_offset = 0;
-
+    // Log the record positions, known up front, with the rows found by the workers
+    printf("Wrote data to %s\n", out_file);
     for (nb = 0; nb < nblocks; nb++) {
-        l = blocks[nb].size + 1;
-        block_start = current_offset;
-
-        // Write the block size
-        fwrite( (char *) &l, 1, sizeof( long ), fp_out );
-        current_offset += sizeof(long);
-
-        for ( i = 0 ; i < l ; i++ ) {
-            if ( blocks[nb].inds[i] == 1 )
-                first = i;
-            if ( blocks[nb].inds[i] == 0 ) {
-                last = i;
-                fputc( '?', fp_out );
-                current_offset += 1; // One character written
-            } else{
-                fputc( blocks[nb].buff[ blocks[nb].inds[i] - 1 ], fp_out );
-                current_offset += 1; // One character written
-            }
-        }
-        fprintf( stderr,
-            "first = %ld"
-            "  last = %ld\n",
-            first,
-            last );
-        fwrite( (char *) &first, 1, sizeof( long ), fp_out );
-        fwrite( (char *) &last, 1, sizeof( long ), fp_out );
-        current_offset += sizeof(long) * 2; // Two longs written
-
-        // Record the end of the block
-        size_t block_end = current_offset;
-
+        size_t block_start = nb * full_record;
+        size_t block_end = (nb == nblocks - 1) ? out_size : block_start + full_record;
         fprintf(fp_log, "Block %d: Start = %zu, End = %zu, first = %ld, last = %ld\n",
-                nb, block_start, block_end, first, last);
+                nb, block_start, block_end, block_first[nb], block_last[nb]);
     }
 
-    fclose(fp_out);
+    close(out_fd);
+    if (hist_fd >= 0 && close(hist_fd)) {
+        fprintf(stderr, "Error writing %s\n", hist_file);
+        return 1;
+    }
     fclose(fp_log);
+    free(block_first);
+    free(block_last);
     return 0;
 }
 
@@ -38,8 +38,13 @@ unsigned char index_to_char [NO_OF_SYMBOLS];
 int char_to_index [NO_OF_CHARS];
 
 // Таблицы частот
-int cum_freq [NO_OF_SYMBOLS + 1];
+// freq[1..NO_OF_SYMBOLS] is kept in a Fenwick tree, cum_freq[i] is
+// total - (freq[1] + ... + freq[i]), so a symbol costs log2(257) steps
+// instead of a pass over the cumulative table
+#define TREE_TOP 256
 int freq [NO_OF_SYMBOLS + 1];
+int tree [NO_OF_SYMBOLS + 1];
+int total;
 
 // Регистры границ и кода
 long low, high;
@@ -126,6 +131,55 @@ int putChar(FILE *out, unsigned char ch)
 
 
 
+//------------------------------------------------------------
+// Fenwick tree of freq[], in O(n)
+void build_tree (void)
+{
+  int i, j;
+
+  total = 0;
+  for ( i = 1; i <= NO_OF_SYMBOLS; i++)
+  {
+    tree [i] = freq [i];
+    total += freq [i];
+  }
+  for ( i = 1; i <= NO_OF_SYMBOLS; i++)
+  {
+    j = i + (i & -i);
+    if (j <= NO_OF_SYMBOLS)
+      tree [j] += tree [i];
+  }
+}
+
+//------------------------------------------------------------
+// cum_freq[symbol]
+int cum_freq_of ( int symbol)
+{
+  int sum = 0;
+
+  for ( ; symbol > 0; symbol &= symbol - 1)
+    sum += tree [symbol];
+  return total - sum;
+}
+
+//------------------------------------------------------------
+// First symbol with cum_freq[symbol] <= cum, and its cum_freq
+int find_symbol ( int cum, int *cum_freq)
+{
+  int pos = 0, step, rest = total - cum;
+
+  for (step = TREE_TOP; step > 0; step >>= 1)
+    if (pos + step <= NO_OF_SYMBOLS && tree [pos + step] < rest)
+    {
+      pos += step;
+      rest -= tree [pos];
+    }
+  if (pos == NO_OF_SYMBOLS)
+    pos--;
+  *cum_freq = cum + rest - freq [pos + 1];
+  return pos + 1;
+}
+
 //------------------------------------------------------------
 // Инициализация адаптивной модели
 void start_model (void)
@@ -138,37 +192,40 @@ void start_model (void)
     index_to_char [i + 1] = i;
   }
   for ( i = 0; i <= NO_OF_SYMBOLS; i++)
-  {
     freq [i] = 1;
-    cum_freq [i] = NO_OF_SYMBOLS - i;
-  }
   freq [0] = 0;
+  build_tree ();
 }
 
 //------------------------------------------------------------
 // Обновление модели очередным символом
 void update_model ( int symbol)
 {
-  int i;
+  int i, lo, hi, mid;
   int ch_i, ch_symbol;
-  int cum;
 
   // проверка на переполнение счетчика частоты
-  if (cum_freq [0] == MAX_FREQUENCY)
+  if (total == MAX_FREQUENCY)
   {
-    cum = 0;
     // масштабирование частот при переполнении
-    for ( i = NO_OF_SYMBOLS; i >= 0; i--)
-    {
+    for ( i = 0; i <= NO_OF_SYMBOLS; i++)
       freq [i] = (freq [i] + 1) / 2;
-      cum_freq [i] = cum;
-      cum += freq [i];
-    }
+    build_tree ();
   }
 
-  for ( i = symbol; freq [i] == freq [i - 1]; i--);
-  if (i < symbol)
+  // first symbol of equal frequency, by bisection: freq[] does not increase
+  i = symbol;
+  if (freq [symbol - 1] == freq [symbol])
   {
+    for (lo = 1, hi = symbol - 1; lo < hi; )
+    {
+      mid = (lo + hi) / 2;
+      if (freq [mid] == freq [symbol])
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    i = lo;
     ch_i                      = index_to_char [i];
     ch_symbol                 = index_to_char [symbol];
     index_to_char [i]         = ch_symbol;
@@ -179,11 +236,19 @@ void update_model ( int symbol)
 
   // обновление значений в таблицах частот
   freq [i] += 1;
-  while (i > 0)
-  {
-    i -= 1;
-    cum_freq [i] += 1;
-  }
+  total += 1;
+  for ( ; i <= NO_OF_SYMBOLS; i += i & -i)
+    tree [i] += 1;
+}
+
+//------------------------------------------------------------
+// Number of leading bits low and high agree on, i.e. the bits the
+// first two cases of the loops below shift out one at a time
+int shared_bits (void)
+{
+  unsigned x = (unsigned) (low ^ high);
+
+  return x ? __builtin_clz (x) - (32 - BITS_IN_REGISTER) : BITS_IN_REGISTER;
 }
 
 //------------------------------------------------------------
@@ -308,26 +373,30 @@ void start_decoding (void)
 void encode_symbol(int symbol)
 {
 	static const unsigned // to save on macro unwinding
-		Half = HALF,
 		FirstQtr = FIRST_QTR,
 		ThirdQtr = THIRD_QTR;
 	// пересчет значений границ
-	const long range = high - low + 1;
-	const int cumFreq0 = cum_freq[0];
-	high = low + (range * cum_freq[symbol - 1]) / cumFreq0 - 1;
-	low = low + (range * cum_freq[symbol]) / cumFreq0;
+	// (range <= 2^16 and frequencies < 2^14 fit 32-bit divisions)
+	const unsigned range = high - low + 1;
+	const unsigned cumFreq0 = total;
+	const unsigned cum = cum_freq_of(symbol);
+	int i, k;
+	high = low + (range * (cum + freq[symbol])) / cumFreq0 - 1;
+	low = low + (range * cum) / cumFreq0;
 	// выдвигание очередных битов
+	k = shared_bits();
+	if (k > 0)
+	{
+		output_bit_plus_follow(low >> (BITS_IN_REGISTER - 1));
+		for (i = 1; i < k; i++)
+			output_bit((low >> (BITS_IN_REGISTER - 1 - i)) & 1);
+		low = (low << k) & TOP_VALUE;
+		high = ((high << k) | ((1L << k) - 1)) & TOP_VALUE;
+	}
+	// the interval straddles Half now, only the middle half can follow
 	for (;;)
 	{
-		if (high < Half)
-			output_bit_plus_follow(0);
-		else if (low >= Half)
-		{
-			output_bit_plus_follow(1);
-			low -= Half;
-			high -= Half;
-		}
-		else if (low >= FirstQtr && high < ThirdQtr)
+		if (low >= FirstQtr && high < ThirdQtr)
 		{
 			bits_to_follow += 1;
 			low -= FirstQtr;
@@ -344,32 +413,32 @@ void encode_symbol(int symbol)
 // Декодирование очередного символа
 int decode_symbol (void)
 {
-  long range;
-  int cum, symbol;
+  unsigned range;
+  int cum, symbol, cum_freq, i, k;
 
   // определение текущего масштаба частот
-  range = (long) (high - low) + 1;
+  range = (unsigned) (high - low) + 1;
   // масштабирование значения в регистре кода
   cum = (int)
-    ((((long) (value - low) + 1) * cum_freq [0] - 1) / range);
+    (((unsigned) (value - low + 1) * total - 1) / range);
   // поиск соответствующего символа в таблице частот
-  for (symbol = 1; cum_freq [symbol] > cum; symbol++);
+  symbol = find_symbol (cum, &cum_freq);
   // пересчет границ
-  high = low + (range * cum_freq [symbol - 1]) / cum_freq [0] - 1;
-  low = low + (range * cum_freq [symbol]) / cum_freq [0];
+  high = low + (range * (cum_freq + freq [symbol])) / total - 1;
+  low = low + (range * cum_freq) / total;
   // удаление очередного символа из входного потока
+  k = shared_bits ();
+  if (k > 0)
+  {
+    for (i = 0; i < k; i++)
+      value = 2 * value + input_bit ();
+    value &= TOP_VALUE;
+    low = (low << k) & TOP_VALUE;
+    high = ((high << k) | ((1L << k) - 1)) & TOP_VALUE;
+  }
   for (;;)
   {
-    if (high < HALF)
-    {
-    }
-    else if (low >= HALF)
-    {
-      value -= HALF;
-      low -= HALF;
-      high -= HALF;
-    }
-    else if (low >= FIRST_QTR && high < THIRD_QTR)
+    if (low >= FIRST_QTR && high < THIRD_QTR)
     {
       value -= FIRST_QTR;
       low -= FIRST_QTR;
@@ -1,13 +1,41 @@
 #!/bin/bash
 
-gcc BWTap2b.c -o exbwtap2 -pthread -lm
+gcc BWTap2b.c sais.c -o exbwtap2 -pthread -lm
 gcc unbwtpa.c -o unbwta -lm
-gcc unbwtpb.c -o unbwtb -lm
 gcc mtf1.c -o mtf1 -Os
 gcc mtf2.c -o mtf2 -Os
-gcc mtf_and_zle1.c -o mtfzle1 -fopenmp -Os
 gcc arith_adapt1.c -o ac1 -Os
 
 g++ nelson/RLE.CPP -o rle0 
 g++ nelson/UNRLE.CPP -o unrle0 
 g++ nelson/UNMTF.CPP -o unmtf0 
+
+# reentrant in-memory codec library
+gcc -O2 -c libpbwtp.c -o libpbwtp.o
+gcc -O2 -c pbwtp_meta.c -o pbwtp_meta.o
+gcc -O2 -c pbwtp_container.c -o pbwtp_container.o
+gcc -O2 -c pbwtp_cluster.c -o pbwtp_cluster.o
+gcc -O2 -c sais.c -o sais.o
+ar rcs libpbwtp.a libpbwtp.o pbwtp_meta.o pbwtp_container.o pbwtp_cluster.o sais.o
+
+# inverse BWT, reads metadata.json with -m
+gcc unbwtpb.c libpbwtp.a -o unbwtb -pthread -lm
+
+# native parallel compress / decompress driver
+gcc -O2 pbwtp.c libpbwtp.a -o pbwtp -pthread -lm
+
+# range coder and static Huffman alternatives to ac1
+gcc -O2 rc1.c libpbwtp.a -o rc1
+gcc -O2 huf1.c libpbwtp.a -o huf1
+
+# fused MTF + zero run coding, replaces rle0 -> mtf2 -> rle0
+gcc -O2 mtf_and_zle1.c libpbwtp.a -o mtfzle1
+
+# buffered rle0 / unrle0
+gcc -O2 rle1.c libpbwtp.a -o rle1
+
+# native megablock clustering, replaces splitf_in_mblocks1.py
+gcc -O2 splitf_in_mblocks2.c libpbwtp.a -o splitf_in_mblocks2 -pthread
+
+# native BWT output reassembly, replaces reconstruct_from_mblocks1.py
+gcc -O2 reconstruct_from_mblocks2.c libpbwtp.a -o reconstruct_from_mblocks2 -pthread
@@ -3,25 +3,32 @@
 my $infile = $ARGV[0];
 my $key = $ARGV[1];
 my $outfolder = $ARGV[2];
+my $coder = defined($ARGV[3]) ? $ARGV[3] : "ac1"; # ac1, rc1 or huf1
+my $stages = defined($ARGV[4]) ? $ARGV[4] : "zle"; # "zle": mtfzle1, "rle": rle1, mtf2, rle1
 
 print "infile: $infile\n";
 print "key: $key\n";
 print "outfolder: $outfolder\n";
 
-print "running RLE..\n";
-$cmd = "./rle0 < $infile > $infile.prle";
-system($cmd);
+if ($stages eq "zle") {
+    print "running MTF + ZLE..\n";
+    $cmd = "./mtfzle1 -f $infile temp/bwt_res2_$key.mtf";
+    system($cmd);
+} else {
+    print "running RLE..\n";
+    $cmd = "./rle1 e $infile $infile.prle";
+    system($cmd);
 
-print "running MTF..\n";
-$cmd = "./mtf2 -f $infile.prle temp/bwt_res_$key.mtf";
-#$cmd = "./mtfzle1 -f $infile.prle temp/bwt_res_$key.mtf";
-system($cmd);
+    print "running MTF..\n";
+    $cmd = "./mtf2 -f $infile.prle temp/bwt_res_$key.mtf";
+    system($cmd);
 
-print "running RLE..\n";
-$cmd = "./rle0 < temp/bwt_res_$key.mtf > temp/bwt_res2_$key.mtf";
-system($cmd);
+    print "running RLE..\n";
+    $cmd = "./rle1 e temp/bwt_res_$key.mtf temp/bwt_res2_$key.mtf";
+    system($cmd);
+}
 
-print "running AC..\n";
-$cmd = "./ac1 e temp/bwt_res2_$key.mtf $outfolder/comp_$key.bzp";
+print "running $coder..\n";
+$cmd = "./$coder e temp/bwt_res2_$key.mtf $outfolder/comp_$key.bzp";
 system($cmd);
 
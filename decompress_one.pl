@@ -2,6 +2,22 @@
 
 my $infile = $ARGV[0];
 my $key = $ARGV[1];
+my $coder = defined($ARGV[2]) ? $ARGV[2] : "ac1"; # the one given to compress_one.pl
+my $stages = defined($ARGV[3]) ? $ARGV[3] : "zle"; # as well
+# with a metadata.json of whole BWT blocks, the megablock is inverted here straight into
+# the output, at the offsets of its blocks
+my $meta = $ARGV[4];
+my $outfile = $ARGV[5];
+my $blsize = $ARGV[6];
+
+sub invert_megablock {
+    return unless defined($meta);
+    print "running megablock inverse BWT..\n";
+    $cmd = "./unbwtb -m $meta temp/file_parts/megablock_$key.dat $outfile $blsize 1";
+    print($cmd);
+    system($cmd);
+    unlink("temp/file_parts/megablock_$key.dat");
+}
 
 print "infile: $infile\n";
 print "key: $key\n";
@@ -9,25 +25,34 @@ print "key: $key\n";
 #$cmd = "rm -rf temp/inverse/ ; mkdir temp/inverse/";
 #system($cmd);
 
-print "running inv AC..\n";
-$cmd = "./ac1 d $infile temp/inverse/inv_ac1_p$key";
+print "running inv $coder..\n";
+$cmd = "./$coder d $infile temp/inverse/inv_ac1_p$key";
 print($cmd);
 system($cmd);
 
+if ($stages eq "zle") {
+    print "running inv MTF + ZLE..\n";
+    $cmd = "./mtfzle1 -i temp/inverse/inv_ac1_p$key temp/file_parts/megablock_$key.dat";
+    print($cmd);
+    system($cmd);
+    invert_megablock();
+    exit;
+}
+
 print "running invRLE..\n";
-$cmd = "./unrle0 < temp/inverse/inv_ac1_p$key > temp/inverse/inv_ac2_p$key";
+$cmd = "./rle1 d temp/inverse/inv_ac1_p$key temp/inverse/inv_ac2_p$key";
 print($cmd);
 system($cmd);
 
 print "running invMTF..\n";
 #$cmd = "./unmtf0 < temp/inverse/inv_ac2_p$key > temp/inverse/inv_ac3_p$key";
 $cmd = "./mtf2 -i temp/inverse/inv_ac2_p$key temp/inverse/inv_ac3_p$key";
-#$cmd = "./mtfzle1 -i temp/inverse/inv_ac2_p$key temp/inverse/inv_ac3_p$key";
 print($cmd);
 system($cmd);
 
 print "running invRLE..\n";
-$cmd = "./unrle0 < temp/inverse/inv_ac3_p$key > temp/file_parts/megablock_$key.dat";
+$cmd = "./rle1 d temp/inverse/inv_ac3_p$key temp/file_parts/megablock_$key.dat";
 print($cmd);
 system($cmd);
+invert_megablock();
 
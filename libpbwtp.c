@@ -0,0 +1,1745 @@
+//
+//  libpbwtp.c
+//  Reentrant in-memory versions of the BWT, RLE, MTF and arithmetic coding stages.
+//  The coders follow BWTap2b.c, unbwtpb.c, nelson/RLE.CPP, nelson/UNRLE.CPP, mtf2.c
+//  and arith_adapt1.c and produce byte-identical output, with all of their state
+//  kept in a pbwtp_ctx.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "libpbwtp.h"
+#include "sais.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Arithmetic coder parameters, as in arith_adapt1.c
+#define BITS_IN_REGISTER 16
+#define TOP_VALUE (((long) 1 << BITS_IN_REGISTER) - 1)
+#define FIRST_QTR (TOP_VALUE / 4 + 1)
+#define HALF (2 * FIRST_QTR)
+#define THIRD_QTR (3 * FIRST_QTR)
+#define NO_OF_CHARS 256
+#define EOF_SYMBOL (NO_OF_CHARS + 1)
+#define NO_OF_SYMBOLS (NO_OF_CHARS + 1)
+#define MAX_FREQUENCY 16383
+#define TREE_TOP 256   // largest power of two <= NO_OF_SYMBOLS
+
+// Range coder parameters: byte-wise renormalization keeps the range above RC_TOP, bit
+// probabilities have RC_PROB_BITS bits and move 1/32 of the way on every coded bit
+#define RC_TOP (1u << 24)
+#define RC_PROB_BITS 12
+#define RC_PROB_ONE (1u << RC_PROB_BITS)
+#define RC_ADAPT_SHIFT 5
+#define RC_CONTEXTS 6
+
+// Static Huffman parameters: symbols per table and the code length limit, which is
+// the size of the decoding table in bits
+#define HUF_CHUNK (1 << 16)
+#define HUF_MAX_BITS 12
+#define HUF_MASK ((1 << HUF_MAX_BITS) - 1)
+
+// Adaptive model, registers and bit i/o of one arithmetic coder
+typedef struct {
+    unsigned char index_to_char[NO_OF_SYMBOLS];
+    int char_to_index[NO_OF_CHARS];
+    int freq[NO_OF_SYMBOLS + 1];
+    int tree[NO_OF_SYMBOLS + 1];   // Fenwick tree of freq[1..NO_OF_SYMBOLS]
+    int total;                     // cum_freq[0] of arith_adapt1.c
+    long low, high, value;
+    long bits_to_follow;
+    int bufvar;
+    int bits_to_go;
+    int garbage_bytes;
+    const unsigned char *in;
+    size_t in_pos, in_size;
+    unsigned char in_last;
+    pbwtp_buf *out;
+    int error;
+} pbwtp_ac;
+
+// Bit probabilities of the range coder in one context: symbol 0, symbol 1, the bit
+// length of larger symbols and, per length, the bits below the leading one
+typedef struct {
+    unsigned short zero, one;
+    unsigned short length[8];
+    unsigned short mantissa[8][128];
+} pbwtp_rc_model;
+
+// Range coder registers; low holds a pending carry in bit 32
+typedef struct {
+    unsigned long long low;
+    unsigned int range;
+    unsigned int code;
+    unsigned char cache;
+    size_t cache_size;
+} pbwtp_rc;
+
+struct pbwtp_ctx {
+    int codec;                 // entropy coder of the fused calls
+    int zle;                   // fused MTF + zero runs in place of RLE -> MTF -> RLE
+    pbwtp_ac ac;
+    pbwtp_rc_model rc_models[RC_CONTEXTS];
+    unsigned short huf_table[1 << HUF_MAX_BITS];  // symbol << 4 | code length
+    pbwtp_buf tmp[3];          // intermediate streams of the fused calls
+    unsigned char *bwt_buff;   // block data and indices / transformation vector of the BWT
+    int *bwt_inds;
+    size_t bwt_capacity;
+    unsigned int *bwt_inverse; // inverse transformation vector, for walking blocks from the end
+    size_t bwt_inverse_capacity;
+};
+
+
+//------------------------------------------------------------
+// Output buffers
+
+void pbwtp_buf_init(pbwtp_buf *buf)
+{
+    buf->data = NULL;
+    buf->size = 0;
+    buf->capacity = 0;
+}
+
+void pbwtp_buf_free(pbwtp_buf *buf)
+{
+    free(buf->data);
+    pbwtp_buf_init(buf);
+}
+
+int pbwtp_buf_reserve(pbwtp_buf *buf, size_t extra)
+{
+    size_t capacity;
+    unsigned char *data;
+
+    if (buf->size + extra <= buf->capacity)
+        return 0;
+    capacity = buf->capacity ? buf->capacity : 4096;
+    while (capacity < buf->size + extra)
+        capacity *= 2;
+    data = (unsigned char *)realloc(buf->data, capacity);
+    if (data == NULL)
+        return -1;
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static inline int buf_put(pbwtp_buf *buf, unsigned char ch)
+{
+    if (buf->size == buf->capacity && pbwtp_buf_reserve(buf, 1))
+        return -1;
+    buf->data[buf->size++] = ch;
+    return 0;
+}
+
+int pbwtp_buf_append(pbwtp_buf *buf, const void *data, size_t n)
+{
+    if (pbwtp_buf_reserve(buf, n))
+        return -1;
+    memcpy(buf->data + buf->size, data, n);
+    buf->size += n;
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Contexts
+
+pbwtp_ctx *pbwtp_ctx_new(void)
+{
+    pbwtp_ctx *ctx = (pbwtp_ctx *)calloc(1, sizeof(pbwtp_ctx));
+    int i;
+
+    if (ctx == NULL)
+        return NULL;
+    for (i = 0; i < 3; i++)
+        pbwtp_buf_init(&ctx->tmp[i]);
+    return ctx;
+}
+
+void pbwtp_ctx_free(pbwtp_ctx *ctx)
+{
+    int i;
+
+    if (ctx == NULL)
+        return;
+    for (i = 0; i < 3; i++)
+        pbwtp_buf_free(&ctx->tmp[i]);
+    free(ctx->bwt_buff);
+    free(ctx->bwt_inds);
+    free(ctx->bwt_inverse);
+    free(ctx);
+}
+
+/* Makes room for a block of n bytes and n+1 indices in the context. */
+static int bwt_reserve(pbwtp_ctx *ctx, size_t n)
+{
+    unsigned char *buff;
+    int *inds;
+
+    if (n <= ctx->bwt_capacity && ctx->bwt_buff != NULL)
+        return 0;
+    buff = (unsigned char *)realloc(ctx->bwt_buff, n + 2);
+    if (buff == NULL)
+        return -1;
+    ctx->bwt_buff = buff;
+    inds = (int *)realloc(ctx->bwt_inds, (n + 2) * sizeof(int));
+    if (inds == NULL)
+        return -1;
+    ctx->bwt_inds = inds;
+    ctx->bwt_capacity = n;
+    return 0;
+}
+
+static int bwt_reserve_inverse(pbwtp_ctx *ctx, size_t n)
+{
+    unsigned int *inverse;
+
+    if (n <= ctx->bwt_inverse_capacity && ctx->bwt_inverse != NULL)
+        return 0;
+    inverse = (unsigned int *)realloc(ctx->bwt_inverse, (n + 2) * sizeof(unsigned int));
+    if (inverse == NULL)
+        return -1;
+    ctx->bwt_inverse = inverse;
+    ctx->bwt_inverse_capacity = n;
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Burrows-Wheeler transform
+
+// indices below this fit next to the symbol in a 32-bit word
+#define BWT_PACKED_LIMIT (1UL << 24)
+
+size_t pbwtp_bwt_record_size(size_t n)
+{
+    return sizeof(long) + (n + 1) + 2 * sizeof(long);
+}
+
+int pbwtp_bwt_encode_block(pbwtp_ctx *ctx, const unsigned char *in, size_t n, unsigned char *record)
+{
+    long i, l, first = 0, last = 0;
+    unsigned char *L = record + sizeof(long);
+
+    if (n > (size_t)0x7ffffffe || bwt_reserve(ctx, n))
+        return -1;
+    memcpy(ctx->bwt_buff, in, n);
+    if (sais_bwt_order(ctx->bwt_buff, ctx->bwt_inds, (int)n))
+        return -1;
+
+    l = (long)n + 1;
+    memcpy(record, &l, sizeof(long));
+    for (i = 0; i < l; i++) {
+        int ind = ctx->bwt_inds[i];
+        if (ind == 1)
+            first = i;
+        if (ind == 0) {
+            last = i;
+            L[i] = '?';
+        } else {
+            L[i] = ctx->bwt_buff[ind - 1];
+        }
+    }
+    memcpy(L + l, &first, sizeof(long));
+    memcpy(L + l + sizeof(long), &last, sizeof(long));
+    return 0;
+}
+
+int pbwtp_bwt_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, size_t block_size, pbwtp_buf *out)
+{
+    size_t pos, len, rsize;
+
+    if (block_size == 0)
+        return -1;
+    for (pos = 0; pos < n; pos += len) {
+        len = (n - pos < block_size) ? n - pos : block_size;
+        rsize = pbwtp_bwt_record_size(len);
+        if (pbwtp_buf_reserve(out, rsize) || pbwtp_bwt_encode_block(ctx, in + pos, len, out->data + out->size))
+            return -1;
+        out->size += rsize;
+    }
+    return 0;
+}
+
+/* Parses the header of the record at in[0..n-1]: the length of the last column, and with
+ * BWTap2b.c -k its negation followed by the number of (position, row) samples. Returns
+ * the size of the whole record, or 0 if it is invalid. */
+static size_t bwt_parse_record(const unsigned char *in, size_t n, long *buflen, long *nsamples,
+                               const unsigned char **samples)
+{
+    size_t header = sizeof(long);
+    long pos, row, prev = 0, m;
+
+    if (n < sizeof(long))
+        return 0;
+    memcpy(buflen, in, sizeof(long));
+    *nsamples = 0;
+    *samples = NULL;
+    if (*buflen < 0) {
+        *buflen = -*buflen;
+        if (n - header < sizeof(long))
+            return 0;
+        memcpy(nsamples, in + header, sizeof(long));
+        header += sizeof(long);
+        if (*nsamples < 0 || (size_t)*nsamples > (n - header) / (2 * sizeof(long)))
+            return 0;
+        *samples = in + header;
+        header += 2 * (size_t)*nsamples * sizeof(long);
+    }
+    if (*buflen < 1 || *buflen > 0x7fffffffL || (size_t)*buflen > n - header
+        || n - header - *buflen < 2 * sizeof(long))
+        return 0;
+    for (m = 0; m < *nsamples; m++) {
+        memcpy(&pos, *samples + 2 * m * sizeof(long), sizeof(long));
+        memcpy(&row, *samples + (2 * m + 1) * sizeof(long), sizeof(long));
+        if (pos < prev || pos > *buflen - 1 || row < 0 || row >= *buflen)
+            return 0;
+        prev = pos;
+    }
+    return header + *buflen + 2 * sizeof(long);
+}
+
+long pbwtp_bwt_block_size(const unsigned char *in, size_t n)
+{
+    long buflen, nsamples;
+    const unsigned char *samples;
+
+    return bwt_parse_record(in, n, &buflen, &nsamples, &samples) ? buflen - 1 : -1;
+}
+
+size_t pbwtp_bwt_record_length(const unsigned char *in, size_t n)
+{
+    long buflen, nsamples;
+    const unsigned char *samples;
+
+    return bwt_parse_record(in, n, &buflen, &nsamples, &samples);
+}
+
+/* Walks the packed vector T forward from every sample to the next one, interleaved, into
+ * out[0..size-1]. */
+static int bwt_walk_samples(const unsigned int *T, unsigned long first, const unsigned char *samples,
+                            long nsamples, long size, unsigned char *out)
+{
+    typedef struct { unsigned int i; size_t j, left; } walk;
+    walk *walks = (walk *)malloc((nsamples + 1) * sizeof(walk));
+    long m, pos, row, start = 0, from = (long)first;
+    size_t steps, s;
+    int nw = 0, k;
+    unsigned int v;
+
+    if (walks == NULL)
+        return -1;
+    for (m = 0; m <= nsamples; m++) {
+        if (m < nsamples) {
+            memcpy(&pos, samples + 2 * m * sizeof(long), sizeof(long));
+            memcpy(&row, samples + (2 * m + 1) * sizeof(long), sizeof(long));
+        } else {
+            pos = size;
+            row = 0;
+        }
+        if (pos > start) {
+            walks[nw].i = (unsigned int)from;
+            walks[nw].j = start;
+            walks[nw].left = pos - start;
+            nw++;
+        }
+        start = pos;
+        from = row;
+    }
+
+    while (nw > 0) {
+        for (steps = walks[0].left, k = 1; k < nw; k++)
+            if (walks[k].left < steps)
+                steps = walks[k].left;
+        for (s = 0; s < steps; s++)
+            for (k = 0; k < nw; k++) {
+                v = T[walks[k].i];
+                out[walks[k].j++] = (unsigned char)v;
+                walks[k].i = v >> 8;
+                __builtin_prefetch(&T[walks[k].i]);
+            }
+        for (k = 0; k < nw; ) {
+            walks[k].left -= steps;
+            if (walks[k].left == 0)
+                walks[k] = walks[--nw];
+            else
+                k++;
+        }
+    }
+    free(walks);
+    return 0;
+}
+
+int pbwtp_bwt_decode_block(pbwtp_ctx *ctx, const unsigned char *in, size_t n, unsigned char *out, size_t *used)
+{
+    long buflen, size, nsamples;
+    const unsigned char *samples;
+    size_t rsize = bwt_parse_record(in, n, &buflen, &nsamples, &samples);
+    unsigned long first, last;
+    unsigned int Count[257], RunningTotal[257];
+    unsigned int *T, *V;
+    const unsigned char *buffer;
+    unsigned int i, j, k, r, w, v, sum, index, half;
+
+    if (rsize == 0)
+        return -1;
+    size = buflen - 1;
+    buffer = in + rsize - buflen - 2 * sizeof(long);
+    memcpy(&first, buffer + buflen, sizeof(first));
+    memcpy(&last, buffer + buflen + sizeof(first), sizeof(last));
+    if (first >= (unsigned long)buflen || bwt_reserve(ctx, buflen))
+        return -1;
+    T = (unsigned int *)ctx->bwt_inds;
+    *used = rsize;
+
+    // Count the occurrences of each byte, the end of buffer marker is symbol 256
+    memset(Count, 0, sizeof(Count));
+    for (i = 0; i < (unsigned int)buflen; i++) {
+        index = (i == last) ? 256 : buffer[i];
+        Count[index]++;
+    }
+    for (sum = 0, i = 0; i < 257; i++) {
+        RunningTotal[i] = sum;
+        sum += Count[i];
+        Count[i] = 0;
+    }
+
+    if ((unsigned long)buflen >= BWT_PACKED_LIMIT || (last >= (unsigned long)buflen && nsamples == 0)) {
+        // Populate the transformation vector T and follow it
+        for (i = 0; i < (unsigned int)buflen; i++) {
+            index = (i == last) ? 256 : buffer[i];
+            T[RunningTotal[index] + Count[index]] = i;
+            Count[index]++;
+        }
+        for (i = first, j = 0; j < (unsigned int)(buflen - 1); j++) {
+            out[j] = buffer[i];
+            i = T[i];
+        }
+        return 0;
+    }
+
+    if (nsamples > 0) {
+        // Packed vector (T[i] << 8) | buffer[i], walked forward from every sample
+        for (i = 0; i < (unsigned int)buflen; i++) {
+            index = (i == last) ? 256 : buffer[i];
+            T[RunningTotal[index] + Count[index]++] = i;
+        }
+        for (i = 0; i < (unsigned int)buflen; i++)
+            T[i] = (T[i] << 8) | buffer[i];
+        return bwt_walk_samples(T, first, samples, nsamples, size, out);
+    }
+
+    // Packed vectors (T[i] << 8) | buffer[i] and (T^-1[i] << 8) | buffer[i]: the first
+    // half of the block is walked forward from first, the second half backward from the
+    // end marker, interleaved so that the cache misses of the two walks overlap
+    if (bwt_reserve_inverse(ctx, buflen))
+        return -1;
+    V = ctx->bwt_inverse;
+    for (i = 0; i < (unsigned int)buflen; i++) {
+        index = (i == last) ? 256 : buffer[i];
+        k = RunningTotal[index] + Count[index]++;
+        T[k] = i;
+        V[i] = (k << 8) | buffer[i];
+    }
+    for (i = 0; i < (unsigned int)buflen; i++)
+        T[i] = (T[i] << 8) | buffer[i];
+
+    half = (unsigned int)size / 2;
+    i = first;
+    r = V[last] >> 8;
+    for (j = 0; j < half; j++) {
+        w = T[i];
+        v = V[r];
+        out[j] = (unsigned char)w;
+        out[size - 1 - j] = (unsigned char)v;
+        i = w >> 8;
+        r = v >> 8;
+        __builtin_prefetch(&T[i]);
+        __builtin_prefetch(&V[r]);
+    }
+    if (size & 1)
+        out[half] = (unsigned char)T[i];
+    return 0;
+}
+
+int pbwtp_bwt_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    size_t pos = 0, used;
+    long size;
+
+    while (pos < n) {
+        size = pbwtp_bwt_block_size(in + pos, n - pos);
+        if (size < 0 || pbwtp_buf_reserve(out, size)
+            || pbwtp_bwt_decode_block(ctx, in + pos, n - pos, out->data + out->size, &used))
+            return -1;
+        out->size += size;
+        pos += used;
+    }
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Run length coding
+
+/* Both directions copy the bytes between runs in bulk: outside of a run the output
+ * repeats the input up to and including the second byte of the next pair, which is the
+ * first position whose byte equals the one before it (0 before the first byte, and the
+ * byte of the run after a run). */
+
+// first i in [pos, n) with in[i] == in[i - 1], or n; pos >= 1
+static inline size_t rle_find_pair(const unsigned char *in, size_t pos, size_t n)
+{
+#ifdef __SSE2__
+    int m;
+
+    for (; pos + 16 <= n; pos += 16) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(in + pos)),
+                                             _mm_loadu_si128((const __m128i *)(in + pos - 1))));
+        if (m)
+            return pos + __builtin_ctz(m);
+    }
+#endif
+    for (; pos < n; pos++)
+        if (in[pos] == in[pos - 1])
+            return pos;
+    return n;
+}
+
+// first i in [pos, n) with in[i] != c, or n
+static inline size_t rle_run_end(const unsigned char *in, size_t pos, size_t n, unsigned char c)
+{
+#ifdef __SSE2__
+    const __m128i key = _mm_set1_epi8((char)c);
+    int m;
+
+    for (; pos + 16 <= n; pos += 16) {
+        m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(in + pos)), key)) & 0xffff;
+        if (m)
+            return pos + __builtin_ctz(m);
+    }
+#endif
+    for (; pos < n; pos++)
+        if (in[pos] != c)
+            return pos;
+    return n;
+}
+
+int pbwtp_rle_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    unsigned char *dst;
+    size_t pos = 0, pair, end, count;
+
+    (void)ctx;
+    // worst case is a pair of equal bytes every two bytes
+    if (pbwtp_buf_reserve(out, n + n / 2 + 2))
+        return -1;
+    dst = out->data + out->size;
+    while (pos < n) {
+        if (pos == 0)
+            pair = in[0] == 0 ? 0 : rle_find_pair(in, 1, n);
+        else
+            pair = rle_find_pair(in, pos, n);
+        end = pair < n ? pair + 1 : n;
+        memcpy(dst, in + pos, end - pos);
+        dst += end - pos;
+        if (pair == n)
+            break;
+        // up to 255 additional repeats, then the byte ending the run
+        pos = rle_run_end(in, end, n - end < 255 ? n : end + 255, in[pair]);
+        count = pos - end;
+        *dst++ = (unsigned char)count;
+        if (count != 255 && pos < n)
+            *dst++ = in[pos++];
+    }
+    out->size = dst - out->data;
+    return 0;
+}
+
+int pbwtp_rle_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    size_t pos = 0, pair, end;
+    int last = 0, count;
+
+    (void)ctx;
+    while (pos < n) {
+        pair = in[pos] == last ? pos : rle_find_pair(in, pos + 1, n);
+        end = pair < n ? pair + 1 : n;
+        if (pbwtp_buf_append(out, in + pos, end - pos))
+            return -1;
+        if (end >= n)
+            break;
+        last = in[pair];
+        count = in[end];
+        if (pbwtp_buf_reserve(out, count))
+            return -1;
+        memset(out->data + out->size, last, count);
+        out->size += count;
+        pos = end + 1;
+    }
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Move to front coding
+
+/* The dictionary (rank to character) of mtf2.c. With SSE2 a rank is found by comparing
+ * 16 entries at a time and ranks below 16 are moved to the front within one register;
+ * larger ranks go to memmove. */
+typedef union {
+#ifdef __SSE2__
+    __m128i v[NO_OF_CHARS / 16];
+#endif
+    unsigned char c[NO_OF_CHARS];
+} mtf_dict;
+
+static void mtf_dict_init(mtf_dict *d)
+{
+    int i;
+
+    for (i = 0; i < NO_OF_CHARS; i++)
+        d->c[i] = (unsigned char)i;
+}
+
+static inline int mtf_rank(const mtf_dict *d, unsigned char ch)
+{
+#ifdef __SSE2__
+    const __m128i key = _mm_set1_epi8((char)ch);
+    int c, m;
+
+    for (c = 0; ; c++) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(d->v[c], key));
+        if (m)
+            return 16 * c + __builtin_ctz(m);
+    }
+#else
+    int rank = 0;
+
+    while (d->c[rank] != ch)
+        rank++;
+    return rank;
+#endif
+}
+
+static inline void mtf_to_front(mtf_dict *d, int rank)
+{
+    unsigned char sym = d->c[rank];
+#ifdef __SSE2__
+    const __m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i v, r, shift;
+
+    if (rank < 16) {
+        v = d->v[0];
+        r = _mm_set1_epi8((char)rank);
+        shift = _mm_cmpeq_epi8(_mm_max_epu8(iota, r), r);
+        d->v[0] = _mm_or_si128(_mm_andnot_si128(shift, v),
+                               _mm_and_si128(shift, _mm_or_si128(_mm_slli_si128(v, 1), _mm_cvtsi32_si128(sym))));
+        return;
+    }
+#endif
+    memmove(d->c + 1, d->c, rank);
+    d->c[0] = sym;
+}
+
+int pbwtp_mtf_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    unsigned char *dst;
+    mtf_dict d;
+    int index;
+    size_t pos;
+
+    (void)ctx;
+    mtf_dict_init(&d);
+    if (pbwtp_buf_reserve(out, n))
+        return -1;
+    dst = out->data + out->size;
+    for (pos = 0; pos < n; pos++) {
+        if (d.c[0] == in[pos]) {
+            dst[pos] = 0;
+            continue;
+        }
+        index = mtf_rank(&d, in[pos]);
+        dst[pos] = (unsigned char)index;
+        mtf_to_front(&d, index);
+    }
+    out->size += n;
+    return 0;
+}
+
+int pbwtp_mtf_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    unsigned char *dst;
+    mtf_dict d;
+    size_t pos;
+
+    (void)ctx;
+    mtf_dict_init(&d);
+    if (pbwtp_buf_reserve(out, n))
+        return -1;
+    dst = out->data + out->size;
+    for (pos = 0; pos < n; pos++) {
+        dst[pos] = d.c[in[pos]];
+        if (in[pos])
+            mtf_to_front(&d, in[pos]);
+    }
+    out->size += n;
+    return 0;
+}
+
+
+
+//------------------------------------------------------------
+// Fused move to front and zero run coding
+
+/* A run of L rank 0 symbols is written as the digits of L in bijective base 2, least
+ * significant first: ZLE_RUNA (0) adds 1 << k and ZLE_RUNB (1) adds 2 << k, so any run
+ * fits without a marker byte or a length limit. A rank r >= 1 is written as r + 1, and
+ * the two largest (254, 255) as ZLE_RANK_ESC followed by r - 254. */
+#define ZLE_RUNA 0
+#define ZLE_RUNB 1
+#define ZLE_RANK_ESC 255
+#define ZLE_MAX_DIGITS 48
+
+static inline unsigned char *zle_put_run(unsigned char *dst, size_t run)
+{
+    while (run) {
+        run--;
+        *dst++ = (unsigned char)(run & 1);
+        run >>= 1;
+    }
+    return dst;
+}
+
+int pbwtp_mtfzle_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    unsigned char *dst;
+    mtf_dict d;
+    size_t pos = 0, start;
+    int index;
+
+    (void)ctx;
+    mtf_dict_init(&d);
+    // a run is never longer than its code, a rank takes at most 2 bytes
+    if (pbwtp_buf_reserve(out, 2 * n))
+        return -1;
+    dst = out->data + out->size;
+    while (pos < n) {
+        start = pos;
+        while (pos < n && in[pos] == d.c[0])
+            pos++;
+        dst = zle_put_run(dst, pos - start);
+        if (pos == n)
+            break;
+        index = mtf_rank(&d, in[pos++]);
+        if (index >= ZLE_RANK_ESC - 1) {
+            *dst++ = ZLE_RANK_ESC;
+            *dst++ = (unsigned char)(index - (ZLE_RANK_ESC - 1));
+        } else {
+            *dst++ = (unsigned char)(index + 1);
+        }
+        mtf_to_front(&d, index);
+    }
+    out->size = dst - out->data;
+    return 0;
+}
+
+int pbwtp_mtfzle_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    size_t pos = 0, run = 0;
+    int digits = 0, index;
+    mtf_dict d;
+
+    (void)ctx;
+    mtf_dict_init(&d);
+    if (pbwtp_buf_reserve(out, n))
+        return -1;
+    for (;;) {
+        if (pos < n && in[pos] <= ZLE_RUNB) {
+            if (digits == ZLE_MAX_DIGITS)
+                return -1;
+            run += (size_t)(in[pos++] + 1) << digits++;
+            continue;
+        }
+        if (run) {
+            if (pbwtp_buf_reserve(out, run))
+                return -1;
+            memset(out->data + out->size, d.c[0], run);
+            out->size += run;
+            run = 0;
+            digits = 0;
+        }
+        if (pos == n)
+            return 0;
+        index = in[pos++] - 1;
+        if (index == ZLE_RANK_ESC - 1) {
+            if (pos == n || in[pos] > 1)
+                return -1;
+            index += in[pos++];
+        }
+        if (buf_put(out, d.c[index]))
+            return -1;
+        mtf_to_front(&d, index);
+    }
+}
+
+//------------------------------------------------------------
+// Adaptive arithmetic coding
+
+/* The model of arith_adapt1.c keeps the symbols sorted by decreasing frequency and
+ * cum_freq[i] = freq[i+1] + ... + freq[NO_OF_SYMBOLS], which costs a pass over up to
+ * 257 entries per update. Here the frequencies are in a Fenwick tree instead, with
+ * cum_freq[i] = total - (freq[1] + ... + freq[i]), so that updates, cumulative
+ * frequencies and the decoder's search take log2(257) steps. The coded intervals
+ * are the same, and so is the output. */
+
+static void ac_build_tree(pbwtp_ac *ac)
+{
+    int i, j;
+
+    ac->total = 0;
+    for (i = 1; i <= NO_OF_SYMBOLS; i++) {
+        ac->tree[i] = ac->freq[i];
+        ac->total += ac->freq[i];
+    }
+    for (i = 1; i <= NO_OF_SYMBOLS; i++) {
+        j = i + (i & -i);
+        if (j <= NO_OF_SYMBOLS)
+            ac->tree[j] += ac->tree[i];
+    }
+}
+
+static void ac_start_model(pbwtp_ac *ac)
+{
+    int i;
+
+    for (i = 0; i < NO_OF_CHARS; i++) {
+        ac->char_to_index[i] = i + 1;
+        ac->index_to_char[i + 1] = (unsigned char)i;
+    }
+    for (i = 0; i <= NO_OF_SYMBOLS; i++)
+        ac->freq[i] = 1;
+    ac->freq[0] = 0;
+    ac_build_tree(ac);
+}
+
+/* cum_freq[symbol] of arith_adapt1.c */
+static inline int ac_cum_freq(const pbwtp_ac *ac, int symbol)
+{
+    int sum = 0;
+
+    for (; symbol > 0; symbol &= symbol - 1)
+        sum += ac->tree[symbol];
+    return ac->total - sum;
+}
+
+/* The first symbol with cum_freq[symbol] <= cum, and its cum_freq. */
+static inline int ac_find_symbol(const pbwtp_ac *ac, int cum, int *cum_freq)
+{
+    int pos = 0, step, rest = ac->total - cum;
+
+    // largest pos with freq[1] + ... + freq[pos] < rest
+    for (step = TREE_TOP; step > 0; step >>= 1) {
+        if (pos + step <= NO_OF_SYMBOLS && ac->tree[pos + step] < rest) {
+            pos += step;
+            rest -= ac->tree[pos];
+        }
+    }
+    if (pos == NO_OF_SYMBOLS)  // only on corrupt input
+        pos--;
+    *cum_freq = cum + rest - ac->freq[pos + 1];
+    return pos + 1;
+}
+
+static void ac_update_model(pbwtp_ac *ac, int symbol)
+{
+    int i, lo, hi, mid, ch_i, ch_symbol;
+
+    // halve the frequencies when the total reaches the limit
+    if (ac->total == MAX_FREQUENCY) {
+        for (i = 0; i <= NO_OF_SYMBOLS; i++)
+            ac->freq[i] = (ac->freq[i] + 1) / 2;
+        ac_build_tree(ac);
+    }
+
+    // keep symbols sorted by frequency: swap with the first one of equal frequency,
+    // found by bisection as the frequencies do not increase with the index
+    i = symbol;
+    if (ac->freq[symbol - 1] == ac->freq[symbol]) {
+        for (lo = 1, hi = symbol - 1; lo < hi; ) {
+            mid = (lo + hi) / 2;
+            if (ac->freq[mid] == ac->freq[symbol])
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        i = lo;
+        ch_i = ac->index_to_char[i];
+        ch_symbol = ac->index_to_char[symbol];
+        ac->index_to_char[i] = (unsigned char)ch_symbol;
+        ac->index_to_char[symbol] = (unsigned char)ch_i;
+        ac->char_to_index[ch_i] = symbol;
+        ac->char_to_index[ch_symbol] = i;
+    }
+
+    ac->freq[i] += 1;
+    ac->total += 1;
+    for (; i <= NO_OF_SYMBOLS; i += i & -i)
+        ac->tree[i] += 1;
+}
+
+static inline void ac_output_bit(pbwtp_ac *ac, int bit)
+{
+    ac->bufvar >>= 1;
+    if (bit)
+        ac->bufvar |= 0x80;
+    if (--ac->bits_to_go == 0) {
+        if (buf_put(ac->out, (unsigned char)ac->bufvar))
+            ac->error = 1;
+        ac->bits_to_go = 8;
+    }
+}
+
+static inline void ac_output_bit_plus_follow(pbwtp_ac *ac, int bit)
+{
+    ac_output_bit(ac, bit);
+    while (ac->bits_to_follow > 0) {
+        ac_output_bit(ac, !bit);
+        ac->bits_to_follow--;
+    }
+}
+
+/* Reads the next bit; past the end of the input the last byte is repeated as garbage,
+ * like the stdio version does, and a corrupt stream is detected by running too far. */
+static inline int ac_input_bit(pbwtp_ac *ac)
+{
+    int t;
+
+    if (ac->bits_to_go == 0) {
+        if (ac->in_pos < ac->in_size) {
+            ac->in_last = ac->in[ac->in_pos++];
+        } else if (++ac->garbage_bytes > BITS_IN_REGISTER / 8 + 1) {
+            ac->error = 1;
+        }
+        ac->bufvar = ac->in_last;
+        ac->bits_to_go = 8;
+    }
+    t = ac->bufvar & 1;
+    ac->bufvar >>= 1;
+    ac->bits_to_go -= 1;
+    return t;
+}
+
+/* Number of leading bits low and high agree on: the bits arith_adapt1.c shifts out one
+ * at a time through its first two cases, taken here in one step. */
+static inline int ac_shared_bits(const pbwtp_ac *ac)
+{
+    unsigned int x = (unsigned int)(ac->low ^ ac->high);
+
+    return x ? __builtin_clz(x) - (32 - BITS_IN_REGISTER) : BITS_IN_REGISTER;
+}
+
+static void ac_encode_symbol(pbwtp_ac *ac, int symbol)
+{
+    // range <= 2^16 and frequencies < 2^14: the products fit 32-bit divisions
+    const unsigned int range = (unsigned int)(ac->high - ac->low + 1);
+    const unsigned int cumFreq0 = ac->total;
+    const unsigned int cum = ac_cum_freq(ac, symbol);
+    int i, k;
+
+    ac->high = ac->low + (range * (cum + ac->freq[symbol])) / cumFreq0 - 1;
+    ac->low = ac->low + (range * cum) / cumFreq0;
+    k = ac_shared_bits(ac);
+    if (k > 0) {
+        ac_output_bit_plus_follow(ac, (int)(ac->low >> (BITS_IN_REGISTER - 1)));
+        for (i = 1; i < k; i++)
+            ac_output_bit(ac, (int)(ac->low >> (BITS_IN_REGISTER - 1 - i)) & 1);
+        ac->low = (ac->low << k) & TOP_VALUE;
+        ac->high = ((ac->high << k) | ((1L << k) - 1)) & TOP_VALUE;
+    }
+    // the interval now straddles HALF, only the middle half can follow
+    for (;;) {
+        if (ac->low >= FIRST_QTR && ac->high < THIRD_QTR) {
+            ac->bits_to_follow += 1;
+            ac->low -= FIRST_QTR;
+            ac->high -= FIRST_QTR;
+        } else {
+            break;
+        }
+        ac->low += ac->low;
+        ac->high += ac->high + 1;
+    }
+}
+
+static int ac_decode_symbol(pbwtp_ac *ac)
+{
+    unsigned int range, total = ac->total;
+    int cum, symbol, cum_freq, i, k;
+
+    range = (unsigned int)(ac->high - ac->low) + 1;
+    cum = (int)(((unsigned int)(ac->value - ac->low + 1) * total - 1) / range);
+    symbol = ac_find_symbol(ac, cum, &cum_freq);
+    ac->high = ac->low + (range * (unsigned int)(cum_freq + ac->freq[symbol])) / total - 1;
+    ac->low = ac->low + (range * (unsigned int)cum_freq) / total;
+    k = ac_shared_bits(ac);
+    if (k > 0) {
+        for (i = 0; i < k; i++)
+            ac->value = 2 * ac->value + ac_input_bit(ac);
+        ac->value &= TOP_VALUE;
+        ac->low = (ac->low << k) & TOP_VALUE;
+        ac->high = ((ac->high << k) | ((1L << k) - 1)) & TOP_VALUE;
+    }
+    for (;;) {
+        if (ac->low >= FIRST_QTR && ac->high < THIRD_QTR) {
+            ac->value -= FIRST_QTR;
+            ac->low -= FIRST_QTR;
+            ac->high -= FIRST_QTR;
+        } else {
+            break;
+        }
+        ac->low = 2 * ac->low;
+        ac->high = 2 * ac->high + 1;
+        ac->value = 2 * ac->value + ac_input_bit(ac);
+    }
+    return symbol;
+}
+
+int pbwtp_ac_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    pbwtp_ac *ac = &ctx->ac;
+    size_t pos;
+    int symbol;
+
+    ac_start_model(ac);
+    ac->out = out;
+    ac->error = 0;
+    ac->bufvar = 0;
+    ac->bits_to_go = 8;
+    ac->low = 0;
+    ac->high = TOP_VALUE;
+    ac->bits_to_follow = 0;
+    // a symbol takes at most about 14 bits, reserve for the common case up front
+    if (pbwtp_buf_reserve(out, n + n / 4 + 16))
+        return -1;
+
+    for (pos = 0; pos < n && !ac->error; pos++) {
+        symbol = ac->char_to_index[in[pos]];
+        ac_encode_symbol(ac, symbol);
+        ac_update_model(ac, symbol);
+    }
+    ac_encode_symbol(ac, EOF_SYMBOL);
+    ac->bits_to_follow++;
+    ac_output_bit_plus_follow(ac, ac->low < FIRST_QTR ? 0 : 1);
+    if (buf_put(out, (unsigned char)(ac->bufvar >> ac->bits_to_go)))
+        ac->error = 1;
+    return ac->error ? -1 : 0;
+}
+
+int pbwtp_ac_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    pbwtp_ac *ac = &ctx->ac;
+    int i, symbol;
+
+    ac_start_model(ac);
+    ac->in = in;
+    ac->in_pos = 0;
+    ac->in_size = n;
+    ac->in_last = 0;
+    ac->garbage_bytes = 0;
+    ac->error = 0;
+    ac->bits_to_go = 0;
+    ac->value = 0;
+    for (i = 1; i <= BITS_IN_REGISTER; i++)
+        ac->value = 2 * ac->value + ac_input_bit(ac);
+    ac->low = 0;
+    ac->high = TOP_VALUE;
+    if (pbwtp_buf_reserve(out, 2 * n))
+        return -1;
+
+    while (!ac->error) {
+        symbol = ac_decode_symbol(ac);
+        if (symbol == EOF_SYMBOL)
+            break;
+        if (buf_put(out, ac->index_to_char[symbol]))
+            return -1;
+        ac_update_model(ac, symbol);
+    }
+    return ac->error ? -1 : 0;
+}
+
+
+//------------------------------------------------------------
+// Range coding
+//
+// The ranks after MTF and RLE are mostly 0 and 1 with a geometric tail, so every symbol
+// is coded as binary decisions: zero or not, one or not, then the bit length class of
+// the symbol and its bits below the leading one. Each decision has an adaptive 12-bit
+// probability, selected by the two previous symbols, which costs a multiplication per
+// bit instead of the divisions and frequency sums of a multi-symbol model.
+
+static void rc_model_init(pbwtp_rc_model *m)
+{
+    unsigned short *p = (unsigned short *)m;
+    size_t i;
+
+    for (i = 0; i < sizeof(*m) / sizeof(*p); i++)
+        p[i] = RC_PROB_ONE / 2;
+}
+
+static inline int rc_context(int prev1, int prev2)
+{
+    return 2 * (prev1 == 0 ? 0 : prev1 < 3 ? 1 : 2) + (prev2 != 0);
+}
+
+/* Moves the probability of a zero bit towards the coded bit, without branching on it. */
+static inline void rc_adapt(unsigned short *p, unsigned int mask)
+{
+    unsigned int prob = *p, up = (RC_PROB_ONE - prob) >> RC_ADAPT_SHIFT;
+
+    *p = (unsigned short)(prob + (up & ~mask) - ((prob >> RC_ADAPT_SHIFT) & mask));
+}
+
+/* Moves the top byte of low to the output, propagating a carry into the bytes held back
+ * while they could still change (a byte 0xff followed by a carry). */
+static inline int rc_shift_low(pbwtp_rc *rc, pbwtp_buf *out)
+{
+    unsigned char carry;
+
+    if ((unsigned int)rc->low < 0xff000000u || (rc->low >> 32) != 0) {
+        carry = (unsigned char)(rc->low >> 32);
+        if (buf_put(out, (unsigned char)(rc->cache + carry)))
+            return -1;
+        for (; rc->cache_size > 1; rc->cache_size--)
+            if (buf_put(out, (unsigned char)(0xff + carry)))
+                return -1;
+        rc->cache_size = 0;
+        rc->cache = (unsigned char)(rc->low >> 24);
+    }
+    rc->cache_size++;
+    rc->low = (rc->low & 0x00ffffffu) << 8;
+    return 0;
+}
+
+static inline int rc_encode_bit(pbwtp_rc *rc, unsigned short *p, int bit, pbwtp_buf *out)
+{
+    unsigned int bound = (rc->range >> RC_PROB_BITS) * *p, mask = -(unsigned int)bit;
+
+    rc->low += bound & mask;
+    rc->range = bit ? rc->range - bound : bound;
+    rc_adapt(p, mask);
+    while (rc->range < RC_TOP) {
+        rc->range <<= 8;
+        if (rc_shift_low(rc, out))
+            return -1;
+    }
+    return 0;
+}
+
+static inline int rc_decode_bit(pbwtp_rc *rc, unsigned short *p, const unsigned char *in, size_t n, size_t *pos)
+{
+    unsigned int bound = (rc->range >> RC_PROB_BITS) * *p, mask;
+    int bit = rc->code >= bound;
+
+    mask = -(unsigned int)bit;
+    rc->code -= bound & mask;
+    rc->range = bit ? rc->range - bound : bound;
+    rc_adapt(p, mask);
+    while (rc->range < RC_TOP) {
+        rc->code = (rc->code << 8) | (*pos < n ? in[*pos] : 0);
+        (*pos)++;
+        rc->range <<= 8;
+    }
+    return bit;
+}
+
+static int rc_encode_symbol(pbwtp_rc *rc, pbwtp_rc_model *m, int symbol, pbwtp_buf *out)
+{
+    int k, b, bit, node;
+
+    if (rc_encode_bit(rc, &m->zero, symbol != 0, out))
+        return -1;
+    if (symbol == 0)
+        return 0;
+    if (rc_encode_bit(rc, &m->one, symbol != 1, out))
+        return -1;
+    if (symbol == 1)
+        return 0;
+    // symbol has k+1 bits, 1 <= k <= 7
+    k = 0;
+    while (symbol >> (k + 1))
+        k++;
+    for (b = 2, node = 1; b >= 0; b--) {
+        bit = ((k - 1) >> b) & 1;
+        if (rc_encode_bit(rc, &m->length[node], bit, out))
+            return -1;
+        node = 2 * node + bit;
+    }
+    for (b = k - 1, node = 1; b >= 0; b--) {
+        bit = (symbol >> b) & 1;
+        if (rc_encode_bit(rc, &m->mantissa[k][node & 127], bit, out))
+            return -1;
+        node = 2 * node + bit;
+    }
+    return 0;
+}
+
+// returns the symbol, or -1 for a length the encoder never writes (corrupt input)
+static int rc_decode_symbol(pbwtp_rc *rc, pbwtp_rc_model *m, const unsigned char *in, size_t n, size_t *pos)
+{
+    int k, b, node;
+
+    if (!rc_decode_bit(rc, &m->zero, in, n, pos))
+        return 0;
+    if (!rc_decode_bit(rc, &m->one, in, n, pos))
+        return 1;
+    for (b = 0, node = 1; b < 3; b++)
+        node = 2 * node + rc_decode_bit(rc, &m->length[node], in, n, pos);
+    k = (node & 7) + 1;
+    if (k > 7)
+        return -1;
+    for (b = 0, node = 1; b < k; b++)
+        node = 2 * node + rc_decode_bit(rc, &m->mantissa[k][node & 127], in, n, pos);
+    return node;
+}
+
+int pbwtp_rc_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    pbwtp_rc rc;
+    unsigned char header[8];
+    size_t pos;
+    int i, prev1 = 0, prev2 = 0;
+
+    // the size up front instead of an end of file symbol
+    for (i = 0; i < 8; i++)
+        header[i] = (unsigned char)((unsigned long long)n >> (8 * i));
+    if (pbwtp_buf_reserve(out, n / 2 + 16) || pbwtp_buf_append(out, header, sizeof(header)))
+        return -1;
+    for (i = 0; i < RC_CONTEXTS; i++)
+        rc_model_init(&ctx->rc_models[i]);
+    rc.low = 0;
+    rc.range = 0xffffffffu;
+    rc.cache = 0;
+    rc.cache_size = 1;
+
+    for (pos = 0; pos < n; pos++) {
+        if (rc_encode_symbol(&rc, &ctx->rc_models[rc_context(prev1, prev2)], in[pos], out))
+            return -1;
+        prev2 = prev1;
+        prev1 = in[pos];
+    }
+    for (i = 0; i < 5; i++)
+        if (rc_shift_low(&rc, out))
+            return -1;
+    return 0;
+}
+
+int pbwtp_rc_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    pbwtp_rc rc;
+    unsigned long long size = 0;
+    size_t pos = 8, i;
+    unsigned char *dst;
+    int symbol, prev1 = 0, prev2 = 0;
+
+    if (n < 8 + 5)
+        return -1;
+    for (i = 0; i < 8; i++)
+        size |= (unsigned long long)in[i] << (8 * i);
+    if (size > ((size_t)-1) / 2 || pbwtp_buf_reserve(out, (size_t)size))
+        return -1;
+    // the first byte is the empty carry cache of the encoder
+    rc.range = 0xffffffffu;
+    rc.code = 0;
+    for (i = 0; i < 5; i++)
+        rc.code = (rc.code << 8) | in[pos++];
+    for (i = 0; i < RC_CONTEXTS; i++)
+        rc_model_init(&ctx->rc_models[i]);
+
+    dst = out->data + out->size;
+    for (i = 0; i < size; i++) {
+        symbol = rc_decode_symbol(&rc, &ctx->rc_models[rc_context(prev1, prev2)], in, n, &pos);
+        if (symbol < 0)
+            return -1;
+        dst[i] = (unsigned char)symbol;
+        prev2 = prev1;
+        prev1 = symbol;
+        // the decoder reads exactly the bytes the encoder wrote, more means a truncated stream
+        if (pos > n)
+            return -1;
+    }
+    out->size += size;
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Static Huffman coding
+//
+// The stream is cut in chunks of HUF_CHUNK symbols, each with its own canonical code,
+// so decoding is a table lookup per symbol with no model to update. A chunk is the 256
+// code lengths packed in nibbles, the byte size of its bit stream and the bit stream,
+// codes written from the least significant bit up.
+
+static void huf_code_lengths(const unsigned int *count, unsigned char *len)
+{
+    unsigned int weight[2 * NO_OF_CHARS];
+    int parent[2 * NO_OF_CHARS], leaf[NO_OF_CHARS];
+    unsigned int scaled[NO_OF_CHARS];
+    int nleaves, nnodes, i, j, a, b, next_leaf, next_node, depth, too_long;
+
+    memcpy(scaled, count, sizeof(scaled));
+    do {
+        // leaves sorted by weight, internal nodes are created in weight order too, so
+        // the two lightest nodes are always at the head of one of the two queues
+        nleaves = 0;
+        for (i = 0; i < NO_OF_CHARS; i++) {
+            len[i] = 0;
+            if (scaled[i] == 0)
+                continue;
+            for (j = nleaves; j > 0 && scaled[leaf[j - 1]] > scaled[i]; j--)
+                leaf[j] = leaf[j - 1];
+            leaf[j] = i;
+            nleaves++;
+        }
+        if (nleaves == 0)
+            return;
+        if (nleaves == 1) {
+            len[leaf[0]] = 1;
+            return;
+        }
+        for (i = 0; i < nleaves; i++)
+            weight[i] = scaled[leaf[i]];
+        nnodes = nleaves;
+        next_leaf = next_node = 0;
+        while (nnodes < 2 * nleaves - 1) {
+            a = (next_leaf < nleaves && (next_node >= nnodes - nleaves || weight[next_leaf] <= weight[nleaves + next_node]))
+                ? next_leaf++ : nleaves + next_node++;
+            b = (next_leaf < nleaves && (next_node >= nnodes - nleaves || weight[next_leaf] <= weight[nleaves + next_node]))
+                ? next_leaf++ : nleaves + next_node++;
+            weight[nnodes] = weight[a] + weight[b];
+            parent[a] = parent[b] = nnodes++;
+        }
+        // depths from the root down, parents always come after their children
+        too_long = 0;
+        parent[nnodes - 1] = -1;
+        weight[nnodes - 1] = 0;
+        for (i = nnodes - 2; i >= 0; i--) {
+            weight[i] = weight[parent[i]] + 1;
+            if (i < nleaves) {
+                depth = (int)weight[i];
+                len[leaf[i]] = (unsigned char)depth;
+                too_long |= depth > HUF_MAX_BITS;
+            }
+        }
+        // flatten the distribution until the code fits the lookup table
+        if (too_long)
+            for (i = 0; i < NO_OF_CHARS; i++)
+                if (scaled[i])
+                    scaled[i] = (scaled[i] + 1) / 2;
+    } while (too_long);
+}
+
+/* Canonical codes of the lengths, bit reversed for LSB first output; -1 if the lengths
+ * are not a prefix code. */
+static int huf_codes(const unsigned char *len, unsigned short *code)
+{
+    unsigned int next[HUF_MAX_BITS + 1], bl_count[HUF_MAX_BITS + 1], kraft = 0, c = 0, r;
+    int i, b;
+
+    memset(bl_count, 0, sizeof(bl_count));
+    for (i = 0; i < NO_OF_CHARS; i++) {
+        if (len[i] > HUF_MAX_BITS)
+            return -1;
+        if (len[i]) {
+            bl_count[len[i]]++;
+            kraft += 1u << (HUF_MAX_BITS - len[i]);
+        }
+    }
+    if (kraft > (1u << HUF_MAX_BITS))
+        return -1;
+    for (b = 1; b <= HUF_MAX_BITS; b++) {
+        c = (c + bl_count[b - 1]) << 1;
+        next[b] = c;
+    }
+    for (i = 0; i < NO_OF_CHARS; i++) {
+        if (len[i] == 0)
+            continue;
+        c = next[len[i]]++;
+        for (r = 0, b = 0; b < len[i]; b++)
+            r |= ((c >> b) & 1) << (len[i] - 1 - b);
+        code[i] = (unsigned short)r;
+    }
+    return 0;
+}
+
+int pbwtp_huf_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    unsigned int count[NO_OF_CHARS];
+    unsigned char len[NO_OF_CHARS], *p;
+    unsigned short code[NO_OF_CHARS];
+    unsigned long long bits;
+    size_t start, end, chunk, i;
+    int nbits;
+
+    (void)ctx;
+    if (pbwtp_buf_reserve(out, 8))
+        return -1;
+    for (i = 0; i < 8; i++)
+        out->data[out->size++] = (unsigned char)((unsigned long long)n >> (8 * i));
+
+    for (start = 0; start < n; start = end) {
+        end = (n - start > HUF_CHUNK) ? start + HUF_CHUNK : n;
+        memset(count, 0, sizeof(count));
+        for (i = start; i < end; i++)
+            count[in[i]]++;
+        huf_code_lengths(count, len);
+        huf_codes(len, code);
+
+        // lengths, room for the stream size, and at most HUF_MAX_BITS per symbol
+        if (pbwtp_buf_reserve(out, NO_OF_CHARS / 2 + 4 + (end - start) * HUF_MAX_BITS / 8 + 8))
+            return -1;
+        p = out->data + out->size;
+        for (i = 0; i < NO_OF_CHARS; i += 2)
+            *p++ = (unsigned char)(len[i] | (len[i + 1] << 4));
+        chunk = (size_t)(p + 4 - out->data);
+        p += 4;
+        bits = 0;
+        nbits = 0;
+        for (i = start; i < end; i++) {
+            bits |= (unsigned long long)code[in[i]] << nbits;
+            nbits += len[in[i]];
+            if (nbits >= 32) {
+                p[0] = (unsigned char)bits;
+                p[1] = (unsigned char)(bits >> 8);
+                p[2] = (unsigned char)(bits >> 16);
+                p[3] = (unsigned char)(bits >> 24);
+                p += 4;
+                bits >>= 32;
+                nbits -= 32;
+            }
+        }
+        for (; nbits > 0; nbits -= 8, bits >>= 8)
+            *p++ = (unsigned char)bits;
+        for (i = 0; i < 4; i++)
+            out->data[chunk - 4 + i] = (unsigned char)((size_t)(p - out->data - chunk) >> (8 * i));
+        out->size = (size_t)(p - out->data);
+    }
+    return 0;
+}
+
+static inline unsigned long long huf_load64(const unsigned char *p)
+{
+    return (unsigned long long)p[0] | ((unsigned long long)p[1] << 8) | ((unsigned long long)p[2] << 16)
+        | ((unsigned long long)p[3] << 24) | ((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40)
+        | ((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+}
+
+int pbwtp_huf_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    unsigned short *table = ctx->huf_table;
+    unsigned char len[NO_OF_CHARS], *dst, *end, *chunk_end;
+    unsigned short code[NO_OF_CHARS];
+    unsigned long long size = 0, bits;
+    const unsigned char *p, *stop;
+    size_t pos = 8, stream_size, i;
+    int nbits, k, entry;
+
+    if (n < 8)
+        return -1;
+    for (i = 0; i < 8; i++)
+        size |= (unsigned long long)in[i] << (8 * i);
+    // every symbol takes a bit at least
+    if (size > 8 * (unsigned long long)(n - 8) || pbwtp_buf_reserve(out, (size_t)size))
+        return -1;
+
+    dst = out->data + out->size;
+    end = dst + size;
+    while (dst < end) {
+        if (n - pos < NO_OF_CHARS / 2 + 4)
+            return -1;
+        for (i = 0; i < NO_OF_CHARS; i += 2) {
+            len[i] = in[pos] & 15;
+            len[i + 1] = in[pos++] >> 4;
+        }
+        stream_size = (size_t)in[pos] | ((size_t)in[pos + 1] << 8) | ((size_t)in[pos + 2] << 16)
+            | ((size_t)in[pos + 3] << 24);
+        pos += 4;
+        if (stream_size > n - pos || huf_codes(len, code))
+            return -1;
+
+        // every HUF_MAX_BITS bit pattern starting with a code maps to its symbol and
+        // length, the rest (of an incomplete code) stays 0
+        memset(table, 0, sizeof(ctx->huf_table));
+        for (i = 0; i < NO_OF_CHARS; i++)
+            if (len[i])
+                for (k = code[i]; k < (1 << HUF_MAX_BITS); k += 1 << len[i])
+                    table[k] = (unsigned short)((i << 4) | len[i]);
+
+        p = in + pos;
+        stop = p + stream_size;
+        chunk_end = (size_t)(end - dst) > HUF_CHUNK ? dst + HUF_CHUNK : end;
+        bits = 0;
+        nbits = 0;
+        // four symbols per refill of whole bytes while the stream has eight left
+        while (chunk_end - dst >= 4 && stop - p >= 8) {
+            bits |= huf_load64(p) << nbits;
+            p += (63 - nbits) >> 3;
+            nbits |= 56;
+            for (k = 0; k < 4; k++) {
+                entry = table[bits & HUF_MASK];
+                if (entry == 0)
+                    return -1;
+                *dst++ = (unsigned char)(entry >> 4);
+                bits >>= entry & 15;
+                nbits -= entry & 15;
+            }
+        }
+        while (dst < chunk_end) {
+            // past the end of the stream, zeros are shifted in
+            for (; nbits <= 56; nbits += 8) {
+                bits |= (unsigned long long)(p < stop ? *p : 0) << nbits;
+                p++;
+            }
+            entry = table[bits & HUF_MASK];
+            if (entry == 0)
+                return -1;
+            *dst++ = (unsigned char)(entry >> 4);
+            bits >>= entry & 15;
+            nbits -= entry & 15;
+        }
+        if (p - nbits / 8 > stop)
+            return -1;
+        pos += stream_size;
+    }
+    out->size += size;
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Fused pipelines
+
+void pbwtp_set_codec(pbwtp_ctx *ctx, int codec)
+{
+    ctx->codec = codec;
+}
+
+void pbwtp_set_zle(pbwtp_ctx *ctx, int zle)
+{
+    ctx->zle = zle;
+}
+
+const char *pbwtp_codec_name(int codec)
+{
+    switch (codec) {
+    case PBWTP_CODEC_RC:
+        return "rc";
+    case PBWTP_CODEC_HUF:
+        return "huf";
+    default:
+        return "ac";
+    }
+}
+
+int pbwtp_codec_from_name(const char *name)
+{
+    if (strcmp(name, "ac") == 0)
+        return PBWTP_CODEC_AC;
+    if (strcmp(name, "rc") == 0)
+        return PBWTP_CODEC_RC;
+    if (strcmp(name, "huf") == 0)
+        return PBWTP_CODEC_HUF;
+    return -1;
+}
+
+static int encode_entropy(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    switch (ctx->codec) {
+    case PBWTP_CODEC_RC:
+        return pbwtp_rc_encode(ctx, in, n, out);
+    case PBWTP_CODEC_HUF:
+        return pbwtp_huf_encode(ctx, in, n, out);
+    default:
+        return pbwtp_ac_encode(ctx, in, n, out);
+    }
+}
+
+static int decode_entropy(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    switch (ctx->codec) {
+    case PBWTP_CODEC_RC:
+        return pbwtp_rc_decode(ctx, in, n, out);
+    case PBWTP_CODEC_HUF:
+        return pbwtp_huf_decode(ctx, in, n, out);
+    default:
+        return pbwtp_ac_decode(ctx, in, n, out);
+    }
+}
+
+int pbwtp_encode_megablock(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    pbwtp_buf *a = &ctx->tmp[0], *b = &ctx->tmp[1];
+
+    a->size = b->size = 0;
+    if (ctx->zle) {
+        if (pbwtp_mtfzle_encode(ctx, in, n, a))
+            return -1;
+        return encode_entropy(ctx, a->data, a->size, out);
+    }
+    if (pbwtp_rle_encode(ctx, in, n, a) || pbwtp_mtf_encode(ctx, a->data, a->size, b))
+        return -1;
+    a->size = 0;
+    if (pbwtp_rle_encode(ctx, b->data, b->size, a))
+        return -1;
+    return encode_entropy(ctx, a->data, a->size, out);
+}
+
+int pbwtp_decode_megablock(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    pbwtp_buf *a = &ctx->tmp[0], *b = &ctx->tmp[1];
+
+    a->size = b->size = 0;
+    if (decode_entropy(ctx, in, n, a))
+        return -1;
+    if (ctx->zle)
+        return pbwtp_mtfzle_decode(ctx, a->data, a->size, out);
+    if (pbwtp_rle_decode(ctx, a->data, a->size, b))
+        return -1;
+    a->size = 0;
+    if (pbwtp_mtf_decode(ctx, b->data, b->size, a))
+        return -1;
+    return pbwtp_rle_decode(ctx, a->data, a->size, out);
+}
+
+
+//------------------------------------------------------------
+// Chunked megablocks
+
+static void put_u32(unsigned char *p, size_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static size_t get_u32(const unsigned char *p)
+{
+    return (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+}
+
+int pbwtp_chunk_count(size_t n, size_t chunk_size)
+{
+    return (int)((n + chunk_size - 1) / chunk_size);
+}
+
+int pbwtp_chunk_join(size_t chunk_size, const pbwtp_buf *chunks, int nchunks, pbwtp_buf *out)
+{
+    int k;
+
+    if (chunk_size > 0xffffffffu || pbwtp_buf_reserve(out, 8 + 4 * (size_t)nchunks))
+        return -1;
+    put_u32(out->data + out->size, (size_t)nchunks);
+    put_u32(out->data + out->size + 4, chunk_size);
+    out->size += 8;
+    for (k = 0; k < nchunks; k++) {
+        if (chunks[k].size > 0xffffffffu)
+            return -1;
+        put_u32(out->data + out->size, chunks[k].size);
+        out->size += 4;
+    }
+    for (k = 0; k < nchunks; k++)
+        if (pbwtp_buf_append(out, chunks[k].data, chunks[k].size))
+            return -1;
+    return 0;
+}
+
+int pbwtp_chunk_info(const unsigned char *in, size_t n, size_t *chunk_size)
+{
+    size_t nchunks, total = 0, k;
+
+    if (n < 8)
+        return -1;
+    nchunks = get_u32(in);
+    *chunk_size = get_u32(in + 4);
+    if (*chunk_size == 0 || nchunks > (n - 8) / 4 || nchunks > 0x7fffffff)
+        return -1;
+    for (k = 0; k < nchunks; k++)
+        total += get_u32(in + 8 + 4 * k);
+    if (total != n - 8 - 4 * nchunks)
+        return -1;
+    return (int)nchunks;
+}
+
+void pbwtp_chunk_locate(const unsigned char *in, int k, size_t *offset, size_t *size)
+{
+    size_t nchunks = get_u32(in);
+    int i;
+
+    *offset = 8 + 4 * nchunks;
+    for (i = 0; i < k; i++)
+        *offset += get_u32(in + 8 + 4 * (size_t)i);
+    *size = get_u32(in + 8 + 4 * (size_t)k);
+}
+
+int pbwtp_encode_chunked(pbwtp_ctx *ctx, const unsigned char *in, size_t n, size_t chunk_size, pbwtp_buf *out)
+{
+    int nchunks = pbwtp_chunk_count(n, chunk_size), k, rc = 0;
+    pbwtp_buf *chunks;
+    size_t start;
+
+    chunks = (pbwtp_buf *)calloc(nchunks + 1, sizeof(pbwtp_buf));
+    if (chunks == NULL)
+        return -1;
+    for (k = 0; k < nchunks && rc == 0; k++) {
+        start = (size_t)k * chunk_size;
+        rc = pbwtp_encode_megablock(ctx, in + start, n - start < chunk_size ? n - start : chunk_size, &chunks[k]);
+    }
+    if (rc == 0)
+        rc = pbwtp_chunk_join(chunk_size, chunks, nchunks, out);
+    for (k = 0; k < nchunks; k++)
+        pbwtp_buf_free(&chunks[k]);
+    free(chunks);
+    return rc;
+}
+
+int pbwtp_decode_chunked(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    size_t chunk_size, offset, size, before;
+    int nchunks = pbwtp_chunk_info(in, n, &chunk_size), k;
+
+    if (nchunks < 0)
+        return -1;
+    for (k = 0; k < nchunks; k++) {
+        pbwtp_chunk_locate(in, k, &offset, &size);
+        before = out->size;
+        if (pbwtp_decode_megablock(ctx, in + offset, size, out))
+            return -1;
+        // all chunks but the last one are full
+        if (out->size - before > chunk_size || (k < nchunks - 1 && out->size - before != chunk_size))
+            return -1;
+    }
+    return 0;
+}
+
+int pbwtp_compress(pbwtp_ctx *ctx, const unsigned char *in, size_t n, size_t block_size, pbwtp_buf *out)
+{
+    pbwtp_buf *c = &ctx->tmp[2];
+
+    c->size = 0;
+    if (pbwtp_bwt_encode(ctx, in, n, block_size, c))
+        return -1;
+    return pbwtp_encode_megablock(ctx, c->data, c->size, out);
+}
+
+int pbwtp_decompress(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out)
+{
+    pbwtp_buf *c = &ctx->tmp[2];
+
+    c->size = 0;
+    if (pbwtp_decode_megablock(ctx, in, n, c))
+        return -1;
+    return pbwtp_bwt_decode(ctx, c->data, c->size, out);
+}
@@ -0,0 +1,212 @@
+//
+//  libpbwtp.h
+//  Reentrant in-memory codecs of the PBWTp compressor
+//
+//  Every stage of the command line tools is available as a buffer to buffer call that
+//  keeps its state in a pbwtp_ctx instead of globals, so any number of blocks can be
+//  coded concurrently in one process (one context per thread). The formats are the
+//  same as the ones written by the tools:
+//
+//    pbwtp_bwt_*   BWTap2b.c / unbwtpb.c block records (length, last column, first, last)
+//    pbwtp_rle_*   nelson/RLE.CPP and nelson/UNRLE.CPP, rle1.c e / d
+//    pbwtp_mtf_*   mtf2.c -f / -i
+//    pbwtp_mtfzle_* mtf_and_zle1.c -f / -i
+//    pbwtp_ac_*    arith_adapt1.c e / d
+//    pbwtp_rc_*    rc1.c e / d
+//    pbwtp_huf_*   huf1.c e / d
+//
+//  pbwtp_encode_megablock() / pbwtp_decode_megablock() run the back-end chain of
+//  compress_one.pl and decompress_one.pl (RLE, MTF, RLE, AC) on one megablock of BWT
+//  output, pbwtp_compress() / pbwtp_decompress() fuse the BWT in front of it. The last
+//  stage is the range coder or static Huffman instead of AC after pbwtp_set_codec(), and
+//  pbwtp_set_zle() replaces RLE, MTF, RLE by the single pass of pbwtp_mtfzle_*.
+//
+//  All calls return 0 on success and -1 on allocation failure or corrupt input.
+//
+
+#ifndef LIBPBWTP_H
+#define LIBPBWTP_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Growable output buffer; calls append to it, so clear size to reuse one.
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+} pbwtp_buf;
+
+void pbwtp_buf_init(pbwtp_buf *buf);
+void pbwtp_buf_free(pbwtp_buf *buf);
+int pbwtp_buf_reserve(pbwtp_buf *buf, size_t extra);
+int pbwtp_buf_append(pbwtp_buf *buf, const void *data, size_t n);
+
+typedef struct pbwtp_ctx pbwtp_ctx;
+
+pbwtp_ctx *pbwtp_ctx_new(void);
+void pbwtp_ctx_free(pbwtp_ctx *ctx);
+
+// BWT of in[0..n-1] in blocks of block_size bytes, written as consecutive block records
+int pbwtp_bwt_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, size_t block_size, pbwtp_buf *out);
+// inverse BWT of a sequence of block records
+int pbwtp_bwt_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// size of the record of a block of n bytes: length, n+1 characters of the last column, first, last
+size_t pbwtp_bwt_record_size(size_t n);
+// BWT of a single block of n bytes into record[0..pbwtp_bwt_record_size(n)-1]
+int pbwtp_bwt_encode_block(pbwtp_ctx *ctx, const unsigned char *in, size_t n, unsigned char *record);
+// inverse BWT of the single record at in[0..n-1] into out[0..record length - 2],
+// *used is set to the size of the record
+int pbwtp_bwt_decode_block(pbwtp_ctx *ctx, const unsigned char *in, size_t n, unsigned char *out, size_t *used);
+// original size of the block whose record starts at in, or -1 if the header is invalid
+long pbwtp_bwt_block_size(const unsigned char *in, size_t n);
+// size of the record starting at in, also with the start samples of BWTap2b.c -k, or 0
+// if the header is invalid
+size_t pbwtp_bwt_record_length(const unsigned char *in, size_t n);
+
+// run length coding: two equal bytes are followed by the count of additional repeats
+int pbwtp_rle_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+int pbwtp_rle_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// move to front coding, one rank per byte
+int pbwtp_mtf_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+int pbwtp_mtf_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// move to front with the runs of rank 0 in bijective base 2 (RUNA 0 / RUNB 1, as in
+// bzip2) and rank r as r + 1, in one pass: replaces RLE -> MTF -> RLE
+int pbwtp_mtfzle_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+int pbwtp_mtfzle_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// adaptive order-0 arithmetic coding terminated by an EOF symbol
+int pbwtp_ac_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+int pbwtp_ac_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// adaptive order-0 range coding with byte-wise renormalization, after an 8 byte size
+int pbwtp_rc_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+int pbwtp_rc_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// static canonical Huffman with a table per 64K symbols, after an 8 byte size:
+// lower ratio than AC and RC, but decoded by table lookups without a model
+int pbwtp_huf_encode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+int pbwtp_huf_decode(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// entropy coder used by the fused calls below, PBWTP_CODEC_AC unless set
+#define PBWTP_CODEC_AC 0
+#define PBWTP_CODEC_RC 1
+#define PBWTP_CODEC_HUF 2
+
+void pbwtp_set_codec(pbwtp_ctx *ctx, int codec);
+const char *pbwtp_codec_name(int codec);
+int pbwtp_codec_from_name(const char *name);  // -1 if unknown
+// nonzero: pbwtp_mtfzle_* in front of the entropy coder, 0 (default): RLE -> MTF -> RLE
+void pbwtp_set_zle(pbwtp_ctx *ctx, int zle);
+
+// RLE -> MTF -> RLE (or MTF + ZLE) -> AC (or RC, HUF) on a megablock of BWT output, and
+// the inverse
+int pbwtp_encode_megablock(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+int pbwtp_decode_megablock(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// Chunked megablocks: the megablock is cut in chunks of chunk_size bytes (the last one
+// shorter), each coded by pbwtp_encode_megablock() on its own, so that the chunks of one
+// megablock can be encoded and decoded on different threads. The compressed megablock
+// is a table, u32 number of chunks, u32 chunk size and the u32 compressed size of every
+// chunk, followed by the chunks.
+int pbwtp_encode_chunked(pbwtp_ctx *ctx, const unsigned char *in, size_t n, size_t chunk_size, pbwtp_buf *out);
+int pbwtp_decode_chunked(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+// number of chunks of n bytes
+int pbwtp_chunk_count(size_t n, size_t chunk_size);
+// appends the table and the compressed chunks[0..nchunks-1]
+int pbwtp_chunk_join(size_t chunk_size, const pbwtp_buf *chunks, int nchunks, pbwtp_buf *out);
+// number of chunks of the chunked megablock in[0..n-1] and its chunk size, or -1 if the
+// table is invalid; then chunk k is in[offset..offset+size-1]
+int pbwtp_chunk_info(const unsigned char *in, size_t n, size_t *chunk_size);
+void pbwtp_chunk_locate(const unsigned char *in, int k, size_t *offset, size_t *size);
+
+// BWT -> RLE -> MTF -> RLE -> AC on raw data, and the inverse
+int pbwtp_compress(pbwtp_ctx *ctx, const unsigned char *in, size_t n, size_t block_size, pbwtp_buf *out);
+int pbwtp_decompress(pbwtp_ctx *ctx, const unsigned char *in, size_t n, pbwtp_buf *out);
+
+// metadata.json: megablock files and the positions of their blocks in the BWT output
+typedef struct {
+    size_t position;
+    size_t size;
+} pbwtp_block_pos;
+
+typedef struct {
+    char *file;              // megablock_file, e.g. temp/file_parts/megablock_3.dat
+    int key;                 // trailing number of the file name, compressed to comp_<key>.bzp
+    pbwtp_block_pos *blocks; // pieces of the BWT output, in megablock order
+    int nblocks, capacity;
+    size_t raw_size;         // sum of the block sizes
+    size_t offset;           // compressed data in a .pbwtp container
+    size_t comp_size;
+    unsigned int crc;        // CRC-32 of the compressed data
+} pbwtp_megablock;
+
+typedef struct {
+    pbwtp_megablock *megablocks;
+    int nmegablocks;
+    int codec;               // PBWTP_CODEC_* of the megablocks, a "codec" key unless AC
+    size_t chunk_size;       // chunked megablocks, a "chunk_size" key unless 0
+    int zle;                 // megablocks coded with pbwtp_set_zle(), a "zle": 1 key
+    int bwt_blocks;          // every block is a whole BWT block record, a "bwt_blocks": 1 key
+} pbwtp_metadata;
+
+void pbwtp_meta_init(pbwtp_metadata *meta);
+void pbwtp_meta_free(pbwtp_metadata *meta);
+int pbwtp_meta_read(const char *path, pbwtp_metadata *meta);
+int pbwtp_meta_write(const char *path, const pbwtp_metadata *meta);
+pbwtp_megablock *pbwtp_meta_add_megablock(pbwtp_metadata *meta, const char *file);
+int pbwtp_meta_add_block(pbwtp_megablock *mb, size_t position, size_t size);
+
+// .pbwtp container: header, compressed megablocks back to back (at any order), then a
+// binary index of the megablocks (offset, sizes, CRC and block map) and a fixed size
+// trailer locating the index, so opening a container takes a read of the trailer and
+// one of the index. Integers are little endian.
+#define PBWTP_CONTAINER_HEADER_SIZE 8
+#define PBWTP_CONTAINER_TRAILER_SIZE 32
+
+unsigned int pbwtp_crc32(unsigned int crc, const void *data, size_t n);
+// appends the container header, which records the codec, chunking and stages of the
+// megablocks
+int pbwtp_container_header(const pbwtp_metadata *meta, pbwtp_buf *out);
+// appends the index and trailer of meta, index_offset being where they will be written
+int pbwtp_container_index(const pbwtp_metadata *meta, size_t index_offset, pbwtp_buf *out);
+// reads the index of the container open on fd
+int pbwtp_container_read_index(int fd, pbwtp_metadata *meta);
+
+// Similarity grouping of blocks (pbwtp_cluster.c), as splitf_in_mblocks1.py: k-means on
+// their byte histograms on nthreads threads, then packing under a megablock size.
+#define PBWTP_HIST_SIZE 256
+#define PBWTP_KMEANS_MAX_THREADS 64
+
+typedef struct {
+    int nclusters;           // at most the number of blocks given to pbwtp_kmeans_fit()
+    int nthreads;
+    float *centers;          // nclusters x PBWTP_HIST_SIZE
+    double *count;           // blocks given to every cluster so far
+    double *sums;            // per thread nclusters x PBWTP_HIST_SIZE sums, then the counts
+    unsigned long long rng;  // fixed seed, so a split can be repeated
+} pbwtp_kmeans;
+
+void pbwtp_byte_histogram(const unsigned char *p, size_t n, float *hist);
+int pbwtp_kmeans_init(pbwtp_kmeans *km, int nclusters, int nthreads);
+void pbwtp_kmeans_free(pbwtp_kmeans *km);
+// k-means++ seeding and Lloyd iterations on nblocks histograms, labels[i] the cluster of block i
+int pbwtp_kmeans_fit(pbwtp_kmeans *km, const float *hist, int nblocks, int *labels);
+// mini-batch step for more blocks: each goes to the nearest center, which moves to the
+// mean of all the blocks it got so far
+int pbwtp_kmeans_update(pbwtp_kmeans *km, const float *hist, int nblocks, int *labels);
+// moves a block whose cluster would exceed max_size to the first cluster with room, or
+// to a new one, then numbers the non empty clusters in order; returns their number or -1
+int pbwtp_pack_clusters(int *labels, const size_t *size, int nblocks, int nclusters, size_t max_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
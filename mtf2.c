@@ -1,138 +1,149 @@
 /*
  * optimized move to front implementation
+ *
+ * Works on blocks of BUF_SIZE bytes in memory. With SSE2 the rank of a symbol is found
+ * by comparing 16 dictionary entries at a time and small ranks are moved to the front
+ * inside one register; the original scalar loops are kept as the reference of the -b
+ * benchmark mode.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-// # max len bytes 
-#define MAX 40980
-// # symbols in alphabet 
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// # bytes per block read from the input
+#define BUF_SIZE (1 << 20)
+// # symbols in alphabet
 #define NO_OF_CHARS 256
-// EOF symbol 
-#define EOF_SYMBOL    (NO_OF_CHARS + 1)
-// Total number of symbols
-#define NO_OF_SYMBOLS (NO_OF_CHARS + 1)
-
-// The tables for recoding
-unsigned char index_to_char[NO_OF_SYMBOLS];
-int char_to_index[NO_OF_CHARS];
-
-// limit registers  
-long low, high;
-long value;
-
-// registers for bit i/o ops 
-long bits_to_follow;
-unsigned char buffer;
-int bits_to_go;
-int garbage_bits;
-
-// file ptrs 
-FILE *in, *out;
-FILE *fd;
-
-unsigned char inputBuffer [MAX];
-unsigned char *currentPtr = 0;
-int dataLeft = 0;
-int rc ;
-unsigned char outputBuffer [MAX];
-
-int outputLength = 0;
-
-/* ******************************************************* */
-/* GetChar - retrieve a char a time with a large buffer    */
-/*                                                         */
-/* ******************************************************* */
-char getChar(FILE *fd, unsigned char *ch)
+
+// dictionary of the block kernels: rank to character, 16 byte aligned for SSE2
+typedef union {
+#ifdef __SSE2__
+    __m128i v[NO_OF_CHARS / 16];
+#endif
+    unsigned char c[NO_OF_CHARS];
+} Dict;
+
+
+void dict_init(Dict *d)
+{
+    int i;
+
+    for (i = 0; i < NO_OF_CHARS; i++)
+        d->c[i] = (unsigned char)i;
+}
+
+#ifdef __SSE2__
+/* rank of ch, which is always in the dictionary */
+static inline int dict_rank(const Dict *d, unsigned char ch)
+{
+    const __m128i key = _mm_set1_epi8((char)ch);
+    int c, m;
+
+    for (c = 0; ; c++) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi8(d->v[c], key));
+        if (m)
+            return 16 * c + __builtin_ctz(m);
+    }
+}
+
+/* Moves the entry at rank to the front. Ranks in the first 16 byte group, most of them
+ * after the BWT, shift that group up by one byte in a register and keep the bytes past
+ * rank; larger ranks are left to memmove, which already copies 16 or 32 bytes at a time. */
+static inline void dict_move_to_front(Dict *d, int rank)
+{
+    const __m128i iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    unsigned char sym = d->c[rank];
+    __m128i v, r, shift;
+
+    if (rank >= 16) {
+        memmove(d->c + 1, d->c, rank);
+        d->c[0] = sym;
+        return;
+    }
+    v = d->v[0];
+    r = _mm_set1_epi8((char)rank);
+    shift = _mm_cmpeq_epi8(_mm_max_epu8(iota, r), r);
+    d->v[0] = _mm_or_si128(_mm_andnot_si128(shift, v),
+                           _mm_and_si128(shift, _mm_or_si128(_mm_slli_si128(v, 1), _mm_cvtsi32_si128(sym))));
+}
+#else
+static inline int dict_rank(const Dict *d, unsigned char ch)
 {
+    int rank = 0;
 
-      if (dataLeft == 0 ) {
-	      rc = fread(inputBuffer, 1, MAX, fd);
-	
-		  if (rc >0 ) {
-		      currentPtr = inputBuffer;
-			  dataLeft = rc;
-		  } else {
-		    // no more data
-		    return -1;
-		  }
-	  }
-	  *ch = (char)*currentPtr++;
-	  dataLeft--;
- 
-	return 1;
- }
- 
-/* ************************************************************ */
-/* flushOutput - Flush out the output buffer                    */                                                   
-/* ************************************************************ */
- void flushOutput(FILE *fd){
-   if (outputLength > 0) 
-      fwrite(outputBuffer, 1, outputLength, fd);
-   return;
- }
- 
-/* ************************************************************ */
-/* putChar - output a char a time with a large buffer           */
-/* must call the flushOutput(FILE *fd) to flush out the buffer  */                                                    
-/* ************************************************************ */
-int putChar(FILE *out, unsigned char ch)
+    while (d->c[rank] != ch)
+        rank++;
+    return rank;
+}
+
+static inline void dict_move_to_front(Dict *d, int rank)
 {
- 
-      if (outputLength >= MAX ) {
-	      rc = fwrite(outputBuffer, 1, MAX, out);
-		   //printf("outputLength = %d, rc=%d\n", outputLength, rc);
-		  if (rc >=0 ) {
-		      outputLength = 0;
-		
-		  } else {
-		    // no more data
-		    return -1;
-		  }
-	  }
-	  outputBuffer[outputLength] = ch;
-	  outputLength++;
-  
-	return 1;
- }
-
-
-void mtf2(char *infile, char *outfile) 
+    unsigned char sym = d->c[rank];
+
+    memmove(d->c + 1, d->c, rank);
+    d->c[0] = sym;
+}
+#endif
+
+/* forward transform of in[0..n-1], continuing from the state in d */
+void mtf_encode_block(Dict *d, const unsigned char *in, unsigned char *out, size_t n)
+{
+    size_t pos;
+    int index;
+
+    for (pos = 0; pos < n; pos++) {
+        // most ranks are 0 after the BWT
+        if (d->c[0] == in[pos]) {
+            out[pos] = 0;
+            continue;
+        }
+        index = dict_rank(d, in[pos]);
+        out[pos] = (unsigned char)index;
+        dict_move_to_front(d, index);
+    }
+}
+
+/* inverse transform of in[0..n-1], continuing from the state in d */
+void mtf_decode_block(Dict *d, const unsigned char *in, unsigned char *out, size_t n)
+{
+    size_t pos;
+
+    for (pos = 0; pos < n; pos++) {
+        out[pos] = d->c[in[pos]];
+        if (in[pos])
+            dict_move_to_front(d, in[pos]);
+    }
+}
+
+
+/* the original kernels: dict[] / map[] shifted one entry at a time */
+void mtf_encode_scalar(const unsigned char *in, unsigned char *out, size_t n)
 {
     int i, check;
     int dict[256];
     int map[256];
+    int index;
+    int charVal;
+    size_t pos;
 
     // Initialize dict (location to character) and map (character to location)
     for(i = 0; i < 256; i++){
         dict[i] = i; // location to character
-        map[i] = i;  // character to location            
+        map[i] = i;  // character to location
     }
-        
-    out = fopen(outfile, "w+b");
-    fd = fopen(infile, "rb");
-
-    if (fd == NULL || out == NULL)
-        return;
 
-    int index;
-    int charVal;
-    unsigned char buffer;
-
-    for (;;)
-    {    
-        // Get the next character from input
-        rc = getChar(fd, &buffer); 
-        if (rc == -1)
-            break;
-
-        charVal = (int)buffer;
+    for (pos = 0; pos < n; pos++)
+    {
+        charVal = in[pos];
         index = map[charVal];  // Look up index of the character from map
 
         // Write the index (MTF encoded value) to the output
-        putChar(out, index);
+        out[pos] = index;
 
         // Move the accessed character to the front of dict
         for(check = index; check != 0; check--) {
@@ -143,58 +154,143 @@ void mtf2(char *infile, char *outfile)
         dict[0] = charVal;       // Place accessed character at front
         map[charVal] = 0;        // Update map with new location of charVal
     }
+}
 
-    // Flush the output buffer and close files
-    flushOutput(out);
-    fclose(fd);
+void mtf_decode_scalar(const unsigned char *in, unsigned char *out, size_t n)
+{
+    unsigned char dict[256];
+    size_t pos;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        dict[i] = i;
+    }
+
+    for (pos = 0; pos < n; pos++) {
+        int index = in[pos];
+
+        // Retrieve the corresponding character from the dictionary
+        unsigned char charVal = dict[index];
+        out[pos] = charVal;
+
+        // Move the accessed character to the front of the dictionary
+        for (j = index; j > 0; j--) {
+            dict[j] = dict[j - 1];
+        }
+        dict[0] = charVal;
+    }
 }
 
 
-/* inverse function */
-void imtf2(const char *infile, const char *outfile) {
+/* forward (encode != 0) or inverse transform of infile, a block at a time */
+void mtf2_file(const char *infile, const char *outfile, int encode)
+{
     FILE *in = fopen(infile, "rb");
     FILE *out = fopen(outfile, "wb");
+    unsigned char *ibuf, *obuf;
+    Dict d;
+    size_t n;
+
     if (!in || !out) {
         perror("File error");
         exit(1);
     }
-
-    // Initialize dictionary
-    unsigned char dict[256];
-    for (int i = 0; i < 256; i++) {
-        dict[i] = i;
+    ibuf = (unsigned char *)malloc(BUF_SIZE);
+    obuf = (unsigned char *)malloc(BUF_SIZE);
+    if (ibuf == NULL || obuf == NULL) {
+        fprintf(stderr, "Error allocating buffers\n");
+        exit(1);
     }
 
-    unsigned char ch;
-    while (fread(&ch, 1, 1, in) == 1) {
-        int index = (int)ch;
-
-        // Check for out-of-bounds access
-        if (index < 0 || index > 255) {
-            fprintf(stderr, "Error: Invalid index %d in input file.\n", index);
-            fclose(in);
-            fclose(out);
+    dict_init(&d);
+    while ((n = fread(ibuf, 1, BUF_SIZE, in)) > 0) {
+        if (encode)
+            mtf_encode_block(&d, ibuf, obuf, n);
+        else
+            mtf_decode_block(&d, ibuf, obuf, n);
+        if (fwrite(obuf, 1, n, out) != n) {
+            fprintf(stderr, "Error writing %s\n", outfile);
             exit(1);
         }
+    }
 
-        // Retrieve the corresponding character from the dictionary
-        unsigned char charVal = dict[index];
+    free(ibuf);
+    free(obuf);
+    fclose(in);
+    fclose(out);
+}
 
-        // Write the character to the output file
-        putChar(out, charVal);
 
-        // Move the accessed character to the front of the dictionary
-        for (int j = index; j > 0; j--) {
-            dict[j] = dict[j - 1];
-        }
-        dict[0] = charVal;
-    }
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-    // Flush any remaining output
-    flushOutput(out);
+/* throughput of the scalar and block kernels on infile, checking they agree */
+int mtf2_bench(const char *infile)
+{
+    FILE *in = fopen(infile, "rb");
+    unsigned char *data, *ref, *enc, *dec;
+    double t[4], best[4] = { 1e30, 1e30, 1e30, 1e30 };
+    long len;
+    int r, k;
+    Dict d;
 
+    if (!in) {
+        perror("File error");
+        return 1;
+    }
+    fseek(in, 0L, SEEK_END);
+    len = ftell(in);
+    rewind(in);
+    data = (unsigned char *)malloc(len + 1);
+    ref = (unsigned char *)malloc(len + 1);
+    enc = (unsigned char *)malloc(len + 1);
+    dec = (unsigned char *)malloc(len + 1);
+    if (!data || !ref || !enc || !dec || fread(data, 1, len, in) != (size_t)len) {
+        fprintf(stderr, "Error reading %s\n", infile);
+        return 1;
+    }
     fclose(in);
-    fclose(out);
+
+    for (r = 0; r < 5; r++) {
+        t[0] = now_sec();
+        mtf_encode_scalar(data, ref, len);
+        t[1] = now_sec();
+        dict_init(&d);
+        mtf_encode_block(&d, data, enc, len);
+        t[2] = now_sec();
+        mtf_decode_scalar(ref, dec, len);
+        t[3] = now_sec();
+        for (k = 0; k < 3; k++)
+            if (t[k + 1] - t[k] < best[k])
+                best[k] = t[k + 1] - t[k];
+        dict_init(&d);
+        mtf_decode_block(&d, enc, dec, len);
+        t[0] = now_sec();
+        if (t[0] - t[3] < best[3])
+            best[3] = t[0] - t[3];
+    }
+    if (memcmp(ref, enc, len) || memcmp(dec, data, len)) {
+        fprintf(stderr, "Mismatch between scalar and block kernels\n");
+        return 1;
+    }
+    printf("%s: %ld bytes, %s kernels\n", infile, len,
+#ifdef __SSE2__
+           "SSE2"
+#else
+           "scalar"
+#endif
+           );
+    printf("forward  scalar %8.1f MB/s   block %8.1f MB/s\n", len / 1e6 / best[0], len / 1e6 / best[1]);
+    printf("inverse  scalar %8.1f MB/s   block %8.1f MB/s\n", len / 1e6 / best[2], len / 1e6 / best[3]);
+    free(data);
+    free(ref);
+    free(enc);
+    free(dec);
+    return 0;
 }
 
 
@@ -202,8 +298,11 @@ void imtf2(const char *infile, const char *outfile) {
 // main command line inputs
 int main(int argc, char* argv[])
 {
+    if (argc == 3 && strcmp(argv[1], "-b") == 0)
+        return mtf2_bench(argv[2]);
     if (argc != 4) {
-        printf("Usage: %s -f|-i infile outfile\n", argv[0]);
+        printf("Usage: %s -f|-i infile outfile\n"
+               "       %s -b infile (throughput of the scalar and block kernels)\n", argv[0], argv[0]);
         return 1;
     }
 
@@ -212,9 +311,9 @@ int main(int argc, char* argv[])
     char *outfile = argv[3];
 
     if (strcmp(mode, "-f") == 0) {
-        mtf2(infile, outfile);
+        mtf2_file(infile, outfile, 1);
     } else if (strcmp(mode, "-i") == 0) {
-        imtf2(infile, outfile);
+        mtf2_file(infile, outfile, 0);
     } else {
         fprintf(stderr, "Invalid mode. Use -f for forward or -i for inverse.\n");
         return 1;
@@ -222,4 +321,3 @@ int main(int argc, char* argv[])
 
    return 0;
 }
-
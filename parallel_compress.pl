@@ -14,7 +14,9 @@ my $blsize = $ARGV[2];
 my $nparts_per_mblock = $ARGV[3];
 my $max_mblock_size = $ARGV[4];
 my $nthreads = $ARGV[5];
-my $megasplit = "cluster"; # set "cluster" or "parts"
+my $coder = defined($ARGV[6]) ? $ARGV[6] : "ac1"; # optional entropy coder: ac1, rc1 or huf1
+my $megasplit = "cluster"; # set "cluster", "stream" (clustered as read, the BWT output is not held in memory) or "parts"
+my $stages = "zle"; # "zle": MTF + zero runs in one pass (mtfzle1), "rle": rle1, mtf2, rle1
 my $cmd;
 
 print "infile: $infile\n";
@@ -63,7 +65,10 @@ close(FH);
 
 # run multi-threaded bwt
 my $bwt_out = "temp/bwt_out.dat";
-$cmd = "./exbwtap2 $infile $bwt_out $blsize";
+my $bwt_hist = "temp/bwt_hist.bin"; # block histograms for the clustering, written by the BWT workers
+# -k 3: each block is inverted in 4 interleaved walks, which keeps a decompression worker busy
+# on a megablock of one or two blocks (about 60 bytes per block)
+$cmd = "./exbwtap2 -t $nthreads -k 3 -H $bwt_hist $infile $bwt_out $blsize";
 print("$cmd\n");
 system($cmd);
 print("finished BWT..\n");
@@ -72,8 +77,10 @@ sleep(.5);
 # split BWT output in parts
 $n = $nparts_per_mblock; 
 print("splitting $bwt_out in $n parts with max mblock size: $max_mblock_size.\n");
-if($megasplit =~ m/cluster/){
-$cmd = "./splitf_in_mblocks1.py $bwt_out temp/file_parts/ $blsize $n $max_mblock_size";
+if($megasplit =~ m/cluster|stream/){
+#$cmd = "./splitf_in_mblocks1.py $bwt_out temp/file_parts/ $blsize $n $max_mblock_size";
+my $sflag = ($megasplit eq "stream") ? "-s " : "";
+$cmd = "./splitf_in_mblocks2 $sflag-H $bwt_hist $bwt_out temp/file_parts/ $blsize $n $max_mblock_size $nthreads";
 } else {
 $cmd = "./splitf_in_mblocks0.pl $bwt_out temp/bwt_log.txt $n temp/file_parts/";
 }
@@ -83,6 +90,21 @@ sleep(.25);
 $cmd = "cp temp/file_parts/metadata.json $outfolder/";
 system($cmd);
 
+# record the stages and the coder for the decompression drivers, as pbwtp -c does
+# ("codec": "rc" or "huf", no key for ac1)
+my ( $codec ) = ( $coder =~ /^(rc|huf)\d*$/ );
+if (($stages eq "zle" || defined($codec)) && -e "$outfolder/metadata.json") {
+    local $/;
+    open(FH, '<', "$outfolder/metadata.json") or die $!;
+    my $json = <FH>;
+    close(FH);
+    $json =~ s/^\{/{\n    "codec": "$codec",/ if defined($codec);
+    $json =~ s/^\{/{\n    "zle": 1,/ if $stages eq "zle";
+    open(FH, '>', "$outfolder/metadata.json") or die $!;
+    print FH $json;
+    close(FH);
+}
+
 # compress the megablocks in parallel
 my @running_processes;
 foreach my $file (glob("temp/file_parts/*dat")) {
@@ -98,7 +120,7 @@ foreach my $file (glob("temp/file_parts/*dat")) {
     printf("file: %s, key: %s\n", $file, $key);
 
     my ($part_num) = $file =~ /part(\d+)\.dat$/;
-    my $command = "./compress_one.pl $file $key $outfolder"; 
+    my $command = "./compress_one.pl $file $key $outfolder $coder $stages"; 
 
     my $pid = fork();
 
@@ -13,7 +13,12 @@ my $infolder = $ARGV[0];
 my $outfile = $ARGV[1];
 my $blsize = $ARGV[2]; # e.g. "2.0MB";
 my $nthreads = $ARGV[3];
+my $coder = defined($ARGV[4]) ? $ARGV[4] : "ac1"; # optional, as given to parallel_compress.pl
+my $codec; # "codec" key of metadata.json, which takes precedence over the argument
+my $chunked = 0; # "chunk_size" key of pbwtp -c with a chunk size, not readable here
 my $megasplit = "cluster"; # set "cluster" or "parts"
+my $stages = "zle"; # "rle" for a metadata.json without the "zle" key of parallel_compress.pl / pbwtp -c
+my $bwt_blocks = 0; # megablocks of whole BWT blocks ("bwt_blocks": 1), inverted by the workers
 my $psout;
 my @keys = ();
 open (FILE, "> temp/keys.txt");
@@ -26,6 +31,33 @@ print "nthreads: $nthreads\n";
 $cmd = "rm -f temp/file_parts/*dat ; rm -f temp/inverse/*";
 system($cmd);
 
+if (open(FH, '<', "$infolder/metadata.json")) {
+    $stages = "rle";
+    while (<FH>) {
+        $stages = "zle" if /"zle": 1/;
+        $bwt_blocks = 1 if /"bwt_blocks": 1/;
+        $codec = $1 if /"codec": "(\w+)"/;
+        $chunked = 1 if /"chunk_size":/;
+    }
+    close(FH);
+}
+# the coders decode a megablock as one stream, not the chunk table of pbwtp -c ... chunk_size
+die "$infolder has chunked megablocks (\"chunk_size\"), use ./pbwtp -d\n" if $chunked;
+# without the key: ac1, or a folder written before the key was recorded, decoded with the argument
+if (defined($codec)) {
+    die "$infolder was compressed with ${codec}1, not $coder\n" if defined($ARGV[4]) && $coder ne "${codec}1";
+    $coder = "${codec}1";
+}
+print "stages: $stages\n";
+print "coder: $coder\n";
+$bwt_blocks = 0 unless $megasplit =~ m/cluster/;
+if ($bwt_blocks) {
+    # the workers write their blocks into it, skipping bwt_recon.out and the full inverse BWT
+    print "megablocks of whole BWT blocks, inverted by the workers\n";
+    open(FH, '>', $outfile) or die "Cannot create $outfile: $!\n";
+    close(FH);
+}
+
 my @running_processes;
 foreach my $file (glob("$infolder/*bzp")) {
     while (scalar(@running_processes) >= $nthreads) {
@@ -41,7 +73,8 @@ foreach my $file (glob("$infolder/*bzp")) {
     printf("file: %s, key: %s\n", $file, $key);
 
     my ($part_num) = $file =~ /part(\d+)\.dat$/;
-    my $command = "./decompress_one.pl $file $key"; 
+    my $command = "./decompress_one.pl $file $key $coder $stages";
+    $command .= " $infolder/metadata.json $outfile $blsize" if $bwt_blocks;
 		print("$command\n");
 
     my $pid = fork();
@@ -90,14 +123,17 @@ printf("ibwt cmd (being performed below..): $cmd\n");
 my $part_dir = "$cwd/temp/file_parts/";
 
 # run reconstruct script
-if($megasplit =~ m/cluster/){
+if($bwt_blocks){
+	print("output written by the megablock workers.\n");
+} elsif($megasplit =~ m/cluster/){
 	print("run reconstruct and ibwt..\n");
 	$cmd = "cp $infolder/metadata.json temp/file_parts/";
 	system($cmd);
-	$cmd = "./reconstruct_from_mblocks1.py temp/file_parts/ temp/bwt_recon.out";
+	#$cmd = "./reconstruct_from_mblocks1.py temp/file_parts/ temp/bwt_recon.out";
+	$cmd = "./reconstruct_from_mblocks2 temp/file_parts/ temp/bwt_recon.out $nthreads";
 	print("$cmd\n");
 	system($cmd);
-	$cmd = " ./unbwtb temp/bwt_recon.out $outfile $blsize";
+	$cmd = " ./unbwtb temp/bwt_recon.out $outfile $blsize $nthreads";
 	print("$cmd\n");
 	system($cmd);
 } else {
@@ -117,7 +153,7 @@ if($megasplit =~ m/cluster/){
 			my ($part_num) = $file =~ /part(\d+)\.dat$/;
 			my $file_out = "$part_dir/uncomp$part_num.dat";
 			#my $command = "./unbwta $file $file_out $blsize"; 
-			my $command = "./unbwtb $file $file_out $blsize"; 
+			my $command = "./unbwtb $file $file_out $blsize 1"; 
 			print("$command\n");
 			
 
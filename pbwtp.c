@@ -0,0 +1,1098 @@
+//
+//  pbwtp.c
+//  Native parallel compression driver: runs the BWT, megablock splitting, entropy coding
+//  and the inverse path in one process on a pool of threads using libpbwtp, instead of
+//  the fork/system calls of parallel_compress.pl and parallel_decompress.pl.
+//  Takes the same arguments as the Perl drivers and reads/writes the same
+//  comp_N.bzp + metadata.json output folder, or a single .pbwtp container file when
+//  the output name ends in .pbwtp (see pbwtp_container.c).
+//  An optional last argument rc or huf of -c codes the megablocks with the range coder
+//  or static Huffman of libpbwtp instead of AC; the archive records it for -d and -x.
+//  A chunk_size after it codes every megablock in independent chunks of that size, so
+//  a single large megablock is still encoded and decoded on all threads.
+//  -x decodes only the megablocks and BWT blocks covering a byte range of the input.
+//  The BWT blocks are grouped in megablocks by k-means on their byte histograms, as
+//  parallel_compress.pl does with splitf_in_mblocks2 -H (pbwtp_cluster.c).
+//  As they are whole block records, -d inverts every megablock right after decoding it and
+//  writes its blocks at their offsets in the output, holding one megablock per thread.
+//  Megablocks are written with the fused MTF + zero run stage (pbwtp_set_zle); archives
+//  without the "zle" key or container flag are decoded with RLE, MTF, RLE as before.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libpbwtp.h"
+
+#define MAX_THREADS 8
+#define MAX_PATH 4096
+
+// Jobs of one stage, pulled by the worker threads; each worker owns a codec context
+typedef int (*job_fn)(void *arg, int job, pbwtp_ctx *ctx);
+
+typedef struct {
+    job_fn fn;
+    void *arg;
+    int njobs;
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+} JobQueue;
+
+// State shared by the jobs of a compression or decompression run
+typedef struct {
+    const char *folder;
+    int fd;                      // .pbwtp container, or -1 for a folder
+    const unsigned char *container;
+    size_t container_size;
+    size_t tail;                 // end of the data written to the container so far
+    pthread_mutex_t lock;
+    const unsigned char *input;  // raw input (compress)
+    size_t input_size;
+    size_t block_size;
+    unsigned char *stream;       // BWT output, i.e. the concatenated block records
+    float *hist;                 // byte histograms of the block records (compress)
+    size_t stream_size;
+    size_t stream_base;          // offset of stream[0] in the BWT output (extraction)
+    int *mb_list;                // megablocks to decode, NULL for all of them
+    int nmb;
+    int *job_mb, *job_chunk;     // megablock and chunk of every coding job
+    int njobs;
+    pbwtp_buf *chunk_out;        // compressed chunk of every job (compress)
+    int *chunks_left;            // chunks of every megablock not coded yet (compress)
+    const unsigned char **mb_data; // compressed megablocks (decompress)
+    size_t *mb_size;
+    size_t *rec_pos;             // record offsets in the stream
+    size_t *out_pos;             // offsets of the decoded blocks in the output
+    int nblocks;
+    unsigned char *output;       // reconstructed input (decompress)
+    size_t output_size;
+    int out_fd;                  // output written block by block (decompress of "bwt_blocks")
+    size_t record;               // size of the records of full blocks
+    pbwtp_metadata meta;
+} Run;
+
+
+size_t convert_to_bytes(const char *size_str) {
+    char *end;
+    double number = strtod(size_str, &end); // Extract numeric part
+
+    // Constants for units
+    const size_t KILOBYTE = 1024;
+    const size_t MEGABYTE = 1024 * 1024;
+    const size_t GIGABYTE = 1024 * 1024 * 1024;
+
+    // Identify the unit and calculate the size in bytes
+    while (*end) { // Process all unit characters
+        switch (*end++) {
+            case 'K': case 'k':
+                return (size_t)(number * KILOBYTE);
+            case 'M': case 'm':
+                return (size_t)(number * MEGABYTE);
+            case 'G': case 'g':
+                return (size_t)(number * GIGABYTE);
+            case 'B': case 'b':
+                break; // 'B' is just a marker for bytes, skip it
+            default:
+                fprintf(stderr, "Unknown unit: %c\n", *(end - 1));
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    return (size_t)round(number);  // If no unit is specified, assume it's just bytes
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int detect_nthreads(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return (ncpu > 0) ? (int)ncpu : MAX_THREADS;
+}
+
+
+//------------------------------------------------------------
+// Thread pool
+
+static void *job_worker(void *arg) {
+    JobQueue *q = (JobQueue *)arg;
+    pbwtp_ctx *ctx = pbwtp_ctx_new();
+    int job;
+
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        job = (ctx != NULL && !q->failed && q->next < q->njobs) ? q->next++ : -1;
+        if (ctx == NULL)
+            q->failed = 1;
+        pthread_mutex_unlock(&q->lock);
+        if (job < 0)
+            break;
+        if (q->fn(q->arg, job, ctx)) {
+            pthread_mutex_lock(&q->lock);
+            q->failed = 1;
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+    pbwtp_ctx_free(ctx);
+    return NULL;
+}
+
+/* Runs jobs 0..njobs-1 on up to nthreads threads. Returns -1 if any job failed. */
+static int run_jobs(int nthreads, int njobs, job_fn fn, void *arg) {
+    JobQueue q;
+    pthread_t *threads;
+    int i, started;
+
+    if (njobs <= 0)
+        return 0;
+    if (nthreads > njobs)
+        nthreads = njobs;
+    q.fn = fn;
+    q.arg = arg;
+    q.njobs = njobs;
+    q.next = 0;
+    q.failed = 0;
+    pthread_mutex_init(&q.lock, NULL);
+    threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    if (threads == NULL)
+        return -1;
+    for (started = 0; started < nthreads; started++)
+        if (pthread_create(&threads[started], NULL, job_worker, &q))
+            break;
+    if (started == 0)
+        q.failed = 1;
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&q.lock);
+    return q.failed ? -1 : 0;
+}
+
+
+//------------------------------------------------------------
+// File helpers
+
+static int write_file(const char *path, const unsigned char *data, size_t n) {
+    FILE *fp = fopen(path, "wb");
+    int rc;
+
+    if (fp == NULL)
+        return -1;
+    rc = (fwrite(data, 1, n, fp) == n) ? 0 : -1;
+    if (fclose(fp))
+        rc = -1;
+    return rc;
+}
+
+/* Maps a whole input file read-only. */
+static const unsigned char *map_file(const char *path, size_t *size) {
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        close(fd);
+        return (const unsigned char *)"";
+    }
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    return (data == MAP_FAILED) ? NULL : (const unsigned char *)data;
+}
+
+
+static int is_container(const char *path) {
+    size_t len = strlen(path);
+    return len >= 6 && strcmp(path + len - 6, ".pbwtp") == 0;
+}
+
+
+//------------------------------------------------------------
+// Compression
+
+static int bwt_job(void *arg, int job, pbwtp_ctx *ctx) {
+    Run *run = (Run *)arg;
+    size_t start = (size_t)job * run->block_size;
+    size_t len = run->input_size - start < run->block_size ? run->input_size - start : run->block_size;
+
+    return pbwtp_bwt_encode_block(ctx, run->input + start, len, run->stream + run->rec_pos[job]);
+}
+
+/* Number of coding jobs of a megablock: one per chunk, or one for the whole of it. */
+static int megablock_chunks(const Run *run, const pbwtp_megablock *mb) {
+    int nchunks = run->meta.chunk_size ? pbwtp_chunk_count(mb->raw_size, run->meta.chunk_size) : 1;
+    return nchunks > 0 ? nchunks : 1;
+}
+
+/* Appends the job of chunk k of megablock i. */
+static int add_job(Run *run, int i, int k) {
+    int *job_mb, *job_chunk;
+
+    if ((run->njobs & (run->njobs - 1)) == 0) {
+        // grown at powers of two
+        job_mb = (int *)realloc(run->job_mb, 2 * (run->njobs + 1) * sizeof(int));
+        if (job_mb == NULL)
+            return -1;
+        run->job_mb = job_mb;
+        job_chunk = (int *)realloc(run->job_chunk, 2 * (run->njobs + 1) * sizeof(int));
+        if (job_chunk == NULL)
+            return -1;
+        run->job_chunk = job_chunk;
+    }
+    run->job_mb[run->njobs] = i;
+    run->job_chunk[run->njobs++] = k;
+    return 0;
+}
+
+static int write_megablock(Run *run, pbwtp_megablock *mb, const pbwtp_buf *out) {
+    char path[MAX_PATH];
+    int rc = 0;
+
+    if (run->fd >= 0) {
+        // megablocks are appended in completion order, the index records where each went
+        pthread_mutex_lock(&run->lock);
+        mb->offset = run->tail;
+        run->tail += out->size;
+        pthread_mutex_unlock(&run->lock);
+        mb->comp_size = out->size;
+        mb->crc = pbwtp_crc32(0, out->data, out->size);
+        if (pwrite(run->fd, out->data, out->size, mb->offset) != (ssize_t)out->size)
+            rc = -1;
+    } else {
+        snprintf(path, sizeof(path), "%s/comp_%d.bzp", run->folder, mb->key);
+        rc = write_file(path, out->data, out->size);
+    }
+    return rc;
+}
+
+/* Bytes [start, start + n) of megablock mb: a pointer into the BWT output when its blocks
+ * covering them are consecutive there, else a copy gathered from them into buf. */
+static const unsigned char *megablock_bytes(const Run *run, const pbwtp_megablock *mb, size_t start, size_t n,
+                                            pbwtp_buf *buf) {
+    size_t off = 0, skip, len, covered;
+    int j, k;
+
+    for (j = 0; j < mb->nblocks - 1 && off + mb->blocks[j].size <= start; j++)
+        off += mb->blocks[j].size;
+    skip = start - off;
+    for (k = j, covered = mb->blocks[j].size - skip; covered < n; k++, covered += mb->blocks[k].size)
+        if (mb->blocks[k + 1].position != mb->blocks[k].position + mb->blocks[k].size)
+            break;
+    if (covered >= n)
+        return run->stream + mb->blocks[j].position + skip;
+
+    buf->size = 0;
+    if (pbwtp_buf_reserve(buf, n))
+        return NULL;
+    for (; n > 0; j++, skip = 0) {
+        len = mb->blocks[j].size - skip < n ? mb->blocks[j].size - skip : n;
+        pbwtp_buf_append(buf, run->stream + mb->blocks[j].position + skip, len);
+        n -= len;
+    }
+    return buf->data;
+}
+
+static int compress_job(void *arg, int job, pbwtp_ctx *ctx) {
+    Run *run = (Run *)arg;
+    pbwtp_megablock *mb = &run->meta.megablocks[run->job_mb[job]];
+    const unsigned char *in;
+    size_t chunk_size = run->meta.chunk_size, start, n;
+    int k = run->job_chunk[job], first = job - k, nchunks, last, rc;
+    pbwtp_buf out, gathered;
+
+    pbwtp_buf_init(&out);
+    pbwtp_buf_init(&gathered);
+    pbwtp_set_codec(ctx, run->meta.codec);
+    pbwtp_set_zle(ctx, run->meta.zle);
+    // the blocks of a megablock are records of the BWT output from all over it
+    start = (size_t)k * chunk_size;
+    n = (chunk_size == 0 || mb->raw_size - start < chunk_size) ? mb->raw_size - start : chunk_size;
+    in = megablock_bytes(run, mb, start, n, &gathered);
+    if (in == NULL) {
+        rc = -1;
+    } else if (chunk_size == 0) {
+        rc = pbwtp_encode_megablock(ctx, in, n, &out);
+        if (rc == 0)
+            rc = write_megablock(run, mb, &out);
+    } else {
+        // the chunks of a megablock are consecutive jobs, the one finishing last joins
+        // and writes them; a failed chunk never counts, so its megablock is not written
+        rc = pbwtp_encode_megablock(ctx, in, n, &run->chunk_out[job]);
+        last = 0;
+        if (rc == 0) {
+            pthread_mutex_lock(&run->lock);
+            last = --run->chunks_left[run->job_mb[job]] == 0;
+            pthread_mutex_unlock(&run->lock);
+        }
+        if (last) {
+            nchunks = megablock_chunks(run, mb);
+            rc = pbwtp_chunk_join(chunk_size, &run->chunk_out[first], nchunks, &out);
+            if (rc == 0)
+                rc = write_megablock(run, mb, &out);
+            for (k = 0; k < nchunks; k++)
+                pbwtp_buf_free(&run->chunk_out[first + k]);
+        }
+    }
+    if (rc)
+        fprintf(stderr, "Error compressing megablock %d\n", mb->key);
+    pbwtp_buf_free(&out);
+    pbwtp_buf_free(&gathered);
+    return rc;
+}
+
+static int hist_job(void *arg, int job, pbwtp_ctx *ctx) {
+    Run *run = (Run *)arg;
+
+    (void)ctx;
+    pbwtp_byte_histogram(run->stream + run->rec_pos[job], run->rec_pos[job + 1] - run->rec_pos[job],
+                         run->hist + (size_t)job * PBWTP_HIST_SIZE);
+    return 0;
+}
+
+/* Groups the BWT records by similarity as splitf_in_mblocks2 -H does: k-means on their
+ * byte histograms into nparts clusters, packed so that no megablock exceeds
+ * max_mblock_size (a single larger block stays whole). The blocks of a megablock are
+ * listed in input order. */
+static int group_blocks(Run *run, int nparts, size_t max_mblock_size, int nthreads) {
+    pbwtp_kmeans km;
+    size_t *size;
+    int *labels, g, k, ngroups, rc = -1;
+    char file[64];
+
+    if (run->nblocks == 0)
+        return 0;
+    size = (size_t *)malloc(run->nblocks * sizeof(size_t));
+    labels = (int *)malloc(run->nblocks * sizeof(int));
+    run->hist = (float *)malloc((size_t)run->nblocks * PBWTP_HIST_SIZE * sizeof(float));
+    if (size == NULL || labels == NULL || run->hist == NULL || pbwtp_kmeans_init(&km, nparts, nthreads))
+        goto done;
+    for (k = 0; k < run->nblocks; k++)
+        size[k] = run->rec_pos[k + 1] - run->rec_pos[k];
+    if (run_jobs(nthreads, run->nblocks, hist_job, run) || pbwtp_kmeans_fit(&km, run->hist, run->nblocks, labels))
+        goto free_km;
+    ngroups = pbwtp_pack_clusters(labels, size, run->nblocks, km.nclusters, max_mblock_size);
+    if (ngroups < 0)
+        goto free_km;
+    for (g = 0; g < ngroups; g++) {
+        snprintf(file, sizeof(file), "temp/file_parts/megablock_%d.dat", g);
+        if (pbwtp_meta_add_megablock(&run->meta, file) == NULL)
+            goto free_km;
+    }
+    for (k = 0; k < run->nblocks; k++)
+        if (pbwtp_meta_add_block(&run->meta.megablocks[labels[k]], run->rec_pos[k], size[k]))
+            goto free_km;
+    rc = 0;
+free_km:
+    pbwtp_kmeans_free(&km);
+done:
+    free(size);
+    free(labels);
+    free(run->hist);
+    run->hist = NULL;
+    return rc;
+}
+
+static int compress(const char *infile, const char *outfolder, size_t block_size, int nparts,
+                    size_t max_mblock_size, int nthreads, int codec, size_t chunk_size) {
+    Run run;
+    char path[MAX_PATH];
+    double t0 = now_ms(), t;
+    int i, k;
+
+    memset(&run, 0, sizeof(run));
+    pbwtp_meta_init(&run.meta);
+    run.meta.codec = codec;
+    run.meta.chunk_size = chunk_size;
+    run.meta.zle = 1;
+    run.meta.bwt_blocks = 1;
+    pthread_mutex_init(&run.lock, NULL);
+    run.folder = outfolder;
+    run.block_size = block_size;
+    run.input = map_file(infile, &run.input_size);
+    run.fd = -1;
+    if (run.input == NULL) {
+        fprintf(stderr, "Error reading %s\n", infile);
+        return 1;
+    }
+    if (is_container(outfolder)) {
+        pbwtp_buf header;
+        pbwtp_buf_init(&header);
+        run.fd = open(outfolder, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (run.fd < 0 || pbwtp_container_header(&run.meta, &header)
+            || write(run.fd, header.data, header.size) != (ssize_t)header.size) {
+            fprintf(stderr, "Error creating %s\n", outfolder);
+            return 1;
+        }
+        run.tail = header.size;
+        pbwtp_buf_free(&header);
+    } else if (mkdir(outfolder, 0755) && errno != EEXIST) {
+        fprintf(stderr, "Error creating %s\n", outfolder);
+        return 1;
+    }
+
+    // every block but the last is full, so all record offsets are known up front
+    run.nblocks = (int)((run.input_size + block_size - 1) / block_size);
+    run.rec_pos = (size_t *)malloc((run.nblocks + 1) * sizeof(size_t));
+    if (run.rec_pos == NULL)
+        return 1;
+    for (k = 0; k <= run.nblocks; k++)
+        run.rec_pos[k] = (size_t)k * pbwtp_bwt_record_size(block_size);
+    if (run.nblocks > 0)
+        run.rec_pos[run.nblocks] = run.rec_pos[run.nblocks - 1]
+            + pbwtp_bwt_record_size(run.input_size - (size_t)(run.nblocks - 1) * block_size);
+    run.stream_size = run.rec_pos[run.nblocks];
+    run.stream = (unsigned char *)malloc(run.stream_size + 1);
+    if (run.stream == NULL) {
+        fprintf(stderr, "Error allocating %zu bytes for the BWT output\n", run.stream_size);
+        return 1;
+    }
+
+    t = now_ms();
+    if (run_jobs(nthreads, run.nblocks, bwt_job, &run)) {
+        fprintf(stderr, "Error in BWT\n");
+        return 1;
+    }
+    printf("BWT of %d blocks: %.1f ms\n", run.nblocks, now_ms() - t);
+
+    t = now_ms();
+    if (group_blocks(&run, nparts, max_mblock_size, nthreads)) {
+        fprintf(stderr, "Error splitting in megablocks\n");
+        return 1;
+    }
+    printf("split in %d megablocks: %.1f ms\n", run.meta.nmegablocks, now_ms() - t);
+
+    run.chunks_left = (int *)malloc((run.meta.nmegablocks + 1) * sizeof(int));
+    if (run.chunks_left == NULL)
+        return 1;
+    for (i = 0; i < run.meta.nmegablocks; i++) {
+        run.chunks_left[i] = megablock_chunks(&run, &run.meta.megablocks[i]);
+        for (k = 0; k < run.chunks_left[i]; k++)
+            if (add_job(&run, i, k))
+                return 1;
+    }
+    run.chunk_out = (pbwtp_buf *)calloc(run.njobs + 1, sizeof(pbwtp_buf));
+    if (run.chunk_out == NULL)
+        return 1;
+
+    t = now_ms();
+    if (run_jobs(nthreads, run.njobs, compress_job, &run))
+        return 1;
+    printf("entropy coding of %d megablocks in %d jobs: %.1f ms\n", run.meta.nmegablocks, run.njobs, now_ms() - t);
+
+    if (run.fd >= 0) {
+        pbwtp_buf index;
+        pbwtp_buf_init(&index);
+        if (pbwtp_container_index(&run.meta, run.tail, &index)
+            || pwrite(run.fd, index.data, index.size, run.tail) != (ssize_t)index.size || close(run.fd)) {
+            fprintf(stderr, "Error writing the index of %s\n", outfolder);
+            return 1;
+        }
+        pbwtp_buf_free(&index);
+    } else {
+        snprintf(path, sizeof(path), "%s/metadata.json", outfolder);
+        if (pbwtp_meta_write(path, &run.meta)) {
+            fprintf(stderr, "Error writing %s\n", path);
+            return 1;
+        }
+    }
+    printf("compressed %s (%zu bytes) to %s in %.1f ms\n", infile, run.input_size, outfolder, now_ms() - t0);
+
+    if (run.input_size > 0)
+        munmap((void *)run.input, run.input_size);
+    free(run.stream);
+    free(run.rec_pos);
+    free(run.job_mb);
+    free(run.job_chunk);
+    free(run.chunk_out);
+    free(run.chunks_left);
+    pthread_mutex_destroy(&run.lock);
+    pbwtp_meta_free(&run.meta);
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Decompression
+
+static void megablock_name(const Run *run, int i, char *path, size_t n) {
+    if (run->container != NULL)
+        snprintf(path, n, "%s megablock %d", run->folder, i);
+    else
+        snprintf(path, n, "%s/comp_%d.bzp", run->folder, run->meta.megablocks[i].key);
+}
+
+/* Maps compressed megablock job of the list and checks its CRC. */
+static int load_job(void *arg, int job, pbwtp_ctx *ctx) {
+    Run *run = (Run *)arg;
+    int i = (run->mb_list != NULL) ? run->mb_list[job] : job;
+    pbwtp_megablock *mb = &run->meta.megablocks[i];
+    char path[MAX_PATH];
+
+    (void)ctx;
+    megablock_name(run, i, path, sizeof(path));
+    if (run->container != NULL) {
+        run->mb_data[i] = run->container + mb->offset;
+        run->mb_size[i] = mb->comp_size;
+        if (pbwtp_crc32(0, run->mb_data[i], run->mb_size[i]) != mb->crc) {
+            fprintf(stderr, "CRC mismatch in %s\n", path);
+            return -1;
+        }
+    } else {
+        run->mb_data[i] = map_file(path, &run->mb_size[i]);
+        if (run->mb_data[i] == NULL) {
+            fprintf(stderr, "Error reading %s\n", path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Copies bytes [raw_off, raw_off + n) of megablock mb, decoded at data, back to their
+ * place in the BWT output, clipped to the part of it held in stream. Returns the number
+ * of bytes that land there; with data NULL they are only counted. */
+static size_t scatter(Run *run, const pbwtp_megablock *mb, size_t raw_off, const unsigned char *data, size_t n) {
+    size_t pos = 0, copied = 0, a, b, lo, hi;
+    int i;
+
+    for (i = 0; i < mb->nblocks; pos += mb->blocks[i++].size) {
+        // piece [a, b) of the range in this block, then its place in the window
+        a = pos > raw_off ? pos : raw_off;
+        b = pos + mb->blocks[i].size < raw_off + n ? pos + mb->blocks[i].size : raw_off + n;
+        if (a >= b)
+            continue;
+        lo = mb->blocks[i].position + (a - pos);
+        hi = lo + (b - a);
+        if (lo < run->stream_base)
+            lo = run->stream_base;
+        if (hi > run->stream_base + run->stream_size)
+            hi = run->stream_base + run->stream_size;
+        if (lo >= hi)
+            continue;
+        if (data != NULL)
+            memcpy(run->stream + (lo - run->stream_base), data + (pos + (lo - mb->blocks[i].position) - raw_off), hi - lo);
+        copied += hi - lo;
+    }
+    return copied;
+}
+
+/* Chunk size of megablock i and, for chunk k, its compressed data and raw offset. */
+static int locate_chunk(const Run *run, int i, int k, const unsigned char **data, size_t *size,
+                        size_t *chunk_size, size_t *raw_off) {
+    size_t offset;
+    int nchunks = 1;
+
+    *data = run->mb_data[i];
+    *size = run->mb_size[i];
+    *chunk_size = run->meta.megablocks[i].raw_size;
+    if (run->meta.chunk_size) {
+        nchunks = pbwtp_chunk_info(*data, *size, chunk_size);
+        if (nchunks < 0 || k >= nchunks || nchunks != pbwtp_chunk_count(run->meta.megablocks[i].raw_size, *chunk_size))
+            return -1;
+        pbwtp_chunk_locate(*data, k, &offset, size);
+        *data += offset;
+    }
+    *raw_off = (size_t)k * *chunk_size;
+    return nchunks;
+}
+
+static int decompress_job(void *arg, int job, pbwtp_ctx *ctx) {
+    Run *run = (Run *)arg;
+    int i = run->job_mb[job], k = run->job_chunk[job], rc = -1;
+    pbwtp_megablock *mb = &run->meta.megablocks[i];
+    const unsigned char *data;
+    size_t size, chunk_size, raw_off;
+    char path[MAX_PATH];
+    pbwtp_buf out;
+
+    pbwtp_buf_init(&out);
+    pbwtp_set_codec(ctx, run->meta.codec);
+    pbwtp_set_zle(ctx, run->meta.zle);
+    if (locate_chunk(run, i, k, &data, &size, &chunk_size, &raw_off) >= 0
+        && raw_off < mb->raw_size && pbwtp_decode_megablock(ctx, data, size, &out) == 0
+        && out.size == (mb->raw_size - raw_off < chunk_size ? mb->raw_size - raw_off : chunk_size)) {
+        scatter(run, mb, raw_off, out.data, out.size);
+        rc = 0;
+    } else {
+        megablock_name(run, i, path, sizeof(path));
+        fprintf(stderr, "Error decompressing %s chunk %d\n", path, k);
+    }
+    pbwtp_buf_free(&out);
+    return rc;
+}
+
+/* Decodes the megablocks of the list (all of them if NULL), one job per chunk that
+ * holds bytes of the part of the BWT output in stream. */
+static int decode_megablocks(Run *run, int nthreads) {
+    const unsigned char *data;
+    size_t size, chunk_size, raw_off;
+    char path[MAX_PATH];
+    double t = now_ms();
+    int j, i, k, nchunks;
+
+    if (run->mb_list == NULL)
+        run->nmb = run->meta.nmegablocks;
+    if (run_jobs(nthreads, run->nmb, load_job, run))
+        return -1;
+    for (j = 0; j < run->nmb; j++) {
+        i = (run->mb_list != NULL) ? run->mb_list[j] : j;
+        nchunks = locate_chunk(run, i, 0, &data, &size, &chunk_size, &raw_off);
+        if (nchunks < 0) {
+            megablock_name(run, i, path, sizeof(path));
+            fprintf(stderr, "Invalid chunk table in %s\n", path);
+            return -1;
+        }
+        for (k = 0; k < nchunks; k++)
+            if (scatter(run, &run->meta.megablocks[i], (size_t)k * chunk_size, NULL, chunk_size) > 0 && add_job(run, i, k))
+                return -1;
+    }
+    if (run_jobs(nthreads, run->njobs, decompress_job, run))
+        return -1;
+    printf("entropy decoding of %d of %d megablocks in %d jobs: %.1f ms\n", run->nmb, run->meta.nmegablocks,
+           run->njobs, now_ms() - t);
+    return 0;
+}
+
+static int ibwt_job(void *arg, int job, pbwtp_ctx *ctx) {
+    Run *run = (Run *)arg;
+    size_t used;
+
+    return pbwtp_bwt_decode_block(ctx, run->stream + run->rec_pos[job], run->stream_size - run->rec_pos[job],
+                                  run->output + run->out_pos[job], &used);
+}
+
+/* Finds the block records of the BWT output and the output offset of every block. */
+static int scan_records(Run *run) {
+    size_t pos = 0, out = 0;
+    long size;
+    int capacity = 0;
+
+    run->nblocks = 0;
+    while (pos < run->stream_size) {
+        size = pbwtp_bwt_block_size(run->stream + pos, run->stream_size - pos);
+        if (size < 0 || (size_t)size > run->block_size)
+            return -1;
+        if (run->nblocks == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            run->rec_pos = (size_t *)realloc(run->rec_pos, capacity * sizeof(size_t));
+            run->out_pos = (size_t *)realloc(run->out_pos, capacity * sizeof(size_t));
+            if (run->rec_pos == NULL || run->out_pos == NULL)
+                return -1;
+        }
+        run->rec_pos[run->nblocks] = pos;
+        run->out_pos[run->nblocks] = out;
+        run->nblocks++;
+        pos += pbwtp_bwt_record_length(run->stream + pos, run->stream_size - pos);
+        out += size;
+    }
+    run->output_size = out;
+    return 0;
+}
+
+/* Size of the records of full blocks. With whole block records in the metadata
+ * ("bwt_blocks") it is that of the record at position 0, which also covers the records of
+ * exbwtap2 -k with their start samples; otherwise records are plain. */
+static size_t full_record_size(const Run *run, size_t block_size) {
+    int i, j;
+
+    if (run->meta.bwt_blocks)
+        for (i = 0; i < run->meta.nmegablocks; i++)
+            for (j = 0; j < run->meta.megablocks[i].nblocks; j++)
+                if (run->meta.megablocks[i].blocks[j].position == 0 &&
+                    run->meta.megablocks[i].blocks[j].size < run->stream_size)
+                    return run->meta.megablocks[i].blocks[j].size;
+    return pbwtp_bwt_record_size(block_size);
+}
+
+/* Decodes all chunks of megablock job and inverts its block records, each written with
+ * pwrite at its offset in the output: with whole block records ("bwt_blocks") the BWT
+ * output is never put back together, and a job holds a single megablock and block. */
+static int invert_job(void *arg, int job, pbwtp_ctx *ctx) {
+    Run *run = (Run *)arg;
+    pbwtp_megablock *mb = &run->meta.megablocks[job];
+    const unsigned char *data;
+    size_t size, chunk_size, raw_off, pos = 0, used, offset;
+    char path[MAX_PATH];
+    pbwtp_buf raw, out;
+    long n;
+    int k, j, nchunks, rc = -1;
+
+    if (load_job(run, job, ctx))
+        return -1;
+    megablock_name(run, job, path, sizeof(path));
+    pbwtp_buf_init(&raw);
+    pbwtp_buf_init(&out);
+    pbwtp_set_codec(ctx, run->meta.codec);
+    pbwtp_set_zle(ctx, run->meta.zle);
+    nchunks = locate_chunk(run, job, 0, &data, &size, &chunk_size, &raw_off);
+    for (k = 0; k < nchunks; k++) {
+        locate_chunk(run, job, k, &data, &size, &chunk_size, &raw_off);
+        if (raw_off >= mb->raw_size || pbwtp_decode_megablock(ctx, data, size, &raw)
+            || raw.size != raw_off + (mb->raw_size - raw_off < chunk_size ? mb->raw_size - raw_off : chunk_size)) {
+            fprintf(stderr, "Error decompressing %s chunk %d\n", path, k);
+            goto done;
+        }
+    }
+    if (nchunks < 0 || raw.size != mb->raw_size || pbwtp_buf_reserve(&out, run->block_size + 1)) {
+        fprintf(stderr, "Error decompressing %s\n", path);
+        goto done;
+    }
+    for (j = 0; j < mb->nblocks; pos += mb->blocks[j++].size) {
+        pbwtp_block_pos *b = &mb->blocks[j];
+        n = pbwtp_bwt_block_size(raw.data + pos, raw.size - pos);
+        if (n < 0 || (size_t)n > run->block_size || b->size > raw.size - pos
+            || (b->position + b->size < run->stream_size && (size_t)n != run->block_size)
+            || pbwtp_bwt_decode_block(ctx, raw.data + pos, b->size, out.data, &used) || used != b->size) {
+            fprintf(stderr, "Invalid BWT block %d in %s\n", j, path);
+            goto done;
+        }
+        offset = b->position / run->record * run->block_size;
+        if (pwrite(run->out_fd, out.data, n, offset) != (ssize_t)n) {
+            fprintf(stderr, "Error writing block %d of %s\n", j, path);
+            goto done;
+        }
+        pthread_mutex_lock(&run->lock);
+        if (offset + n > run->output_size)
+            run->output_size = offset + n;
+        pthread_mutex_unlock(&run->lock);
+    }
+    rc = 0;
+done:
+    if (run->container == NULL && run->mb_size[job] > 0)
+        munmap((void *)run->mb_data[job], run->mb_size[job]);
+    run->mb_data[job] = NULL;
+    pbwtp_buf_free(&raw);
+    pbwtp_buf_free(&out);
+    return rc;
+}
+
+/* Decompresses an archive of whole block records one megablock per job, so that memory
+ * scales with the megablocks instead of the input. The records of full blocks all have
+ * the size of the one at position 0, which gives the output offset of every block. */
+static int invert_megablocks(Run *run, const char *outfile, int nthreads) {
+    size_t covered = 0;
+    double t = now_ms();
+    int i, j, rc;
+
+    run->record = full_record_size(run, run->block_size);
+    for (i = 0; i < run->meta.nmegablocks; i++)
+        for (j = 0; j < run->meta.megablocks[i].nblocks; j++) {
+            pbwtp_block_pos *b = &run->meta.megablocks[i].blocks[j];
+            if (run->record < run->block_size || b->position % run->record != 0
+                || (b->position + b->size < run->stream_size && b->size != run->record)) {
+                fprintf(stderr, "BWT output of %s does not match block size %zu\n", run->folder, run->block_size);
+                return -1;
+            }
+            covered += b->size;
+        }
+    if (covered != run->stream_size) {
+        fprintf(stderr, "Blocks of %s do not cover the BWT output\n", run->folder);
+        return -1;
+    }
+    run->out_fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (run->out_fd < 0) {
+        fprintf(stderr, "Error writing %s\n", outfile);
+        return -1;
+    }
+    pthread_mutex_init(&run->lock, NULL);
+    rc = run_jobs(nthreads, run->meta.nmegablocks, invert_job, run);
+    pthread_mutex_destroy(&run->lock);
+    if (close(run->out_fd))
+        rc = -1;
+    if (rc == 0)
+        printf("entropy decoding and inverse BWT of %d megablocks: %.1f ms\n", run->meta.nmegablocks, now_ms() - t);
+    return rc;
+}
+
+/* Reads the megablock map of a folder or .pbwtp container; sets stream_size to the size
+ * of the whole BWT output. */
+static int open_archive(Run *run, const char *infolder, size_t block_size) {
+    struct stat st;
+    char path[MAX_PATH];
+    int i, j;
+
+    memset(run, 0, sizeof(*run));
+    run->folder = infolder;
+    run->block_size = block_size;
+    run->fd = -1;
+    if (stat(infolder, &st) == 0 && S_ISREG(st.st_mode)) {
+        // one read of the trailer and index, then the megablocks straight from the mapping
+        run->fd = open(infolder, O_RDONLY);
+        if (run->fd < 0 || pbwtp_container_read_index(run->fd, &run->meta)) {
+            fprintf(stderr, "Error reading the index of %s\n", infolder);
+            return -1;
+        }
+        run->container = map_file(infolder, &run->container_size);
+        if (run->container == NULL)
+            return -1;
+    } else {
+        snprintf(path, sizeof(path), "%s/metadata.json", infolder);
+        if (pbwtp_meta_read(path, &run->meta)) {
+            fprintf(stderr, "Error reading %s\n", path);
+            return -1;
+        }
+    }
+    run->mb_data = (const unsigned char **)calloc(run->meta.nmegablocks + 1, sizeof(*run->mb_data));
+    run->mb_size = (size_t *)calloc(run->meta.nmegablocks + 1, sizeof(size_t));
+    if (run->mb_data == NULL || run->mb_size == NULL)
+        return -1;
+    for (i = 0; i < run->meta.nmegablocks; i++) {
+        if (run->meta.megablocks[i].key < 0) {
+            fprintf(stderr, "No key in megablock file name %s\n", run->meta.megablocks[i].file);
+            return -1;
+        }
+        for (j = 0; j < run->meta.megablocks[i].nblocks; j++) {
+            pbwtp_block_pos *b = &run->meta.megablocks[i].blocks[j];
+            if (b->position + b->size > run->stream_size)
+                run->stream_size = b->position + b->size;
+        }
+    }
+    return 0;
+}
+
+static void close_archive(Run *run) {
+    int i;
+
+    if (run->fd >= 0) {
+        munmap((void *)run->container, run->container_size);
+        close(run->fd);
+    } else if (run->mb_data != NULL) {
+        for (i = 0; i < run->meta.nmegablocks; i++)
+            if (run->mb_data[i] != NULL && run->mb_size[i] > 0)
+                munmap((void *)run->mb_data[i], run->mb_size[i]);
+    }
+    free(run->mb_data);
+    free(run->mb_size);
+    free(run->job_mb);
+    free(run->job_chunk);
+    free(run->stream);
+    free(run->output);
+    free(run->rec_pos);
+    free(run->out_pos);
+    free(run->mb_list);
+    pbwtp_meta_free(&run->meta);
+}
+
+static int decompress(const char *infolder, const char *outfile, size_t block_size, int nthreads) {
+    Run run;
+    double t0 = now_ms(), t;
+
+    if (open_archive(&run, infolder, block_size))
+        return 1;
+    if (run.meta.bwt_blocks) {
+        if (invert_megablocks(&run, outfile, nthreads))
+            return 1;
+        printf("decompressed %s to %s (%zu bytes) in %.1f ms\n", infolder, outfile, run.output_size, now_ms() - t0);
+        close_archive(&run);
+        return 0;
+    }
+    run.stream = (unsigned char *)malloc(run.stream_size + 1);
+    if (run.stream == NULL)
+        return 1;
+
+    if (decode_megablocks(&run, nthreads))
+        return 1;
+
+    if (scan_records(&run)) {
+        fprintf(stderr, "Invalid BWT block in the reconstructed stream\n");
+        return 1;
+    }
+    run.output = (unsigned char *)malloc(run.output_size + 1);
+    if (run.output == NULL)
+        return 1;
+    t = now_ms();
+    if (run_jobs(nthreads, run.nblocks, ibwt_job, &run)) {
+        fprintf(stderr, "Error in inverse BWT\n");
+        return 1;
+    }
+    printf("inverse BWT of %d blocks: %.1f ms\n", run.nblocks, now_ms() - t);
+
+    if (write_file(outfile, run.output, run.output_size)) {
+        fprintf(stderr, "Error writing %s\n", outfile);
+        return 1;
+    }
+    printf("decompressed %s to %s (%zu bytes) in %.1f ms\n", infolder, outfile, run.output_size, now_ms() - t0);
+
+    close_archive(&run);
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Range extraction
+
+/* Writes bytes [offset, offset + length) of the original input. All BWT blocks but the
+ * last one have block_size bytes, so the records covering the range are found from the
+ * size of a full record; only the megablocks holding pieces of them are decoded, and only
+ * those records inverted. */
+static int extract(const char *infolder, const char *outfile, size_t block_size, size_t offset, size_t length,
+                   int nthreads) {
+    Run run;
+    size_t record, total, last, start, end, skip;
+    double t0 = now_ms(), t;
+    int i, j, k0, k1, nmb = 0;
+    long size;
+
+    if (open_archive(&run, infolder, block_size))
+        return 1;
+    record = full_record_size(&run, block_size);
+    if (record < block_size) {
+        fprintf(stderr, "BWT output of %s does not match block size %zu\n", infolder, block_size);
+        return 1;
+    }
+
+    // size of the original input: full blocks and the shorter last record, whose header is
+    // that of the full ones (with a single record, an upper bound checked once it is decoded)
+    run.nblocks = (int)((run.stream_size + record - 1) / record);
+    last = run.stream_size - (run.nblocks > 0 ? (size_t)(run.nblocks - 1) * record : 0);
+    if (run.nblocks > 0 && last < pbwtp_bwt_record_size(0)) {
+        fprintf(stderr, "BWT output of %s does not match block size %zu\n", infolder, block_size);
+        return 1;
+    }
+    if (run.nblocks > 1)
+        total = (size_t)(run.nblocks - 1) * block_size + (last > record - block_size ? last - (record - block_size) : 0);
+    else
+        total = run.nblocks > 0 ? last - pbwtp_bwt_record_size(0) : 0;
+    if (offset >= total || length == 0) {
+        close_archive(&run);
+        if (length == 0)
+            return write_file(outfile, (const unsigned char *)"", 0) ? 1 : 0;
+        fprintf(stderr, "Range starts past the end of the input (%zu bytes)\n", total);
+        return 1;
+    }
+    if (length > total - offset)
+        length = total - offset;
+
+    k0 = (int)(offset / block_size);
+    k1 = (int)((offset + length - 1) / block_size);
+    start = (size_t)k0 * record;
+    end = (size_t)(k1 + 1) * record < run.stream_size ? (size_t)(k1 + 1) * record : run.stream_size;
+    run.stream_base = start;
+    run.stream_size = end - start;
+    run.stream = (unsigned char *)malloc(run.stream_size + 1);
+    run.mb_list = (int *)malloc((run.meta.nmegablocks + 1) * sizeof(int));
+    if (run.stream == NULL || run.mb_list == NULL)
+        return 1;
+    for (i = 0; i < run.meta.nmegablocks; i++)
+        for (j = 0; j < run.meta.megablocks[i].nblocks; j++) {
+            pbwtp_block_pos *b = &run.meta.megablocks[i].blocks[j];
+            if (b->position < end && b->position + b->size > start) {
+                run.mb_list[nmb++] = i;
+                break;
+            }
+        }
+
+    run.nmb = nmb;
+    if (decode_megablocks(&run, nthreads))
+        return 1;
+
+    run.nblocks = k1 - k0 + 1;
+    run.rec_pos = (size_t *)malloc(run.nblocks * sizeof(size_t));
+    run.out_pos = (size_t *)malloc(run.nblocks * sizeof(size_t));
+    if (run.rec_pos == NULL || run.out_pos == NULL)
+        return 1;
+    run.output_size = 0;
+    for (i = 0; i < run.nblocks; i++) {
+        run.rec_pos[i] = (size_t)i * record;
+        run.out_pos[i] = run.output_size;
+        size = pbwtp_bwt_block_size(run.stream + run.rec_pos[i], run.stream_size - run.rec_pos[i]);
+        if (size < 0 || (size_t)size > block_size || (k0 + i < k1 && (size_t)size != block_size)) {
+            fprintf(stderr, "Invalid BWT block %d for block size %zu\n", k0 + i, block_size);
+            return 1;
+        }
+        run.output_size += size;
+    }
+    skip = offset - (size_t)k0 * block_size;
+    if (skip >= run.output_size) {
+        fprintf(stderr, "Range starts past the end of the input (%zu bytes)\n", (size_t)k0 * block_size + run.output_size);
+        return 1;
+    }
+    if (length > run.output_size - skip)
+        length = run.output_size - skip;
+    run.output = (unsigned char *)malloc(run.output_size + 1);
+    if (run.output == NULL)
+        return 1;
+    t = now_ms();
+    if (run_jobs(nthreads, run.nblocks, ibwt_job, &run)) {
+        fprintf(stderr, "Error in inverse BWT\n");
+        return 1;
+    }
+    printf("inverse BWT of %d blocks: %.1f ms\n", run.nblocks, now_ms() - t);
+
+    if (write_file(outfile, run.output + skip, length)) {
+        fprintf(stderr, "Error writing %s\n", outfile);
+        return 1;
+    }
+    printf("extracted bytes %zu..%zu of %s to %s in %.1f ms\n", offset, offset + length, infolder, outfile,
+           now_ms() - t0);
+
+    close_archive(&run);
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    int nthreads;
+
+    if (argc >= 8 && argc <= 10 && strcmp(argv[1], "-c") == 0) {
+        const char *infile = argv[2];
+        char cmd[2 * MAX_PATH];
+        struct stat st;
+        int codec = (argc >= 9) ? pbwtp_codec_from_name(argv[8]) : PBWTP_CODEC_AC;
+        size_t chunk_size = (argc == 10) ? convert_to_bytes(argv[9]) : 0;
+
+        if (codec < 0) {
+            fprintf(stderr, "Unknown codec %s, use ac, rc or huf\n", argv[8]);
+            return 1;
+        }
+
+        if (stat(infile, &st)) {
+            fprintf(stderr, "%s does not exist.\n", infile);
+            return 1;
+        }
+        // archive if directory input, like parallel_compress.pl
+        if (S_ISDIR(st.st_mode)) {
+            snprintf(cmd, sizeof(cmd), "tar -czvf archive.tar.gz %s", infile);
+            if (system(cmd) != 0) {
+                fprintf(stderr, "Error creating tar archive\n");
+                return 1;
+            }
+            printf("Directory %s archived to archive.tar.gz\n", infile);
+            infile = "archive.tar.gz";
+        }
+        nthreads = atoi(argv[7]);
+        return compress(infile, argv[3], convert_to_bytes(argv[4]), atoi(argv[5]),
+                        convert_to_bytes(argv[6]), nthreads > 0 ? nthreads : detect_nthreads(), codec, chunk_size);
+    }
+    if (argc == 8 && strcmp(argv[1], "-x") == 0) {
+        nthreads = atoi(argv[7]);
+        return extract(argv[2], argv[3], convert_to_bytes(argv[4]), strtoull(argv[5], NULL, 10),
+                       strtoull(argv[6], NULL, 10), nthreads > 0 ? nthreads : detect_nthreads());
+    }
+    if (argc == 6 && strcmp(argv[1], "-d") == 0) {
+        nthreads = atoi(argv[5]);
+        return decompress(argv[2], argv[3], convert_to_bytes(argv[4]),
+                          nthreads > 0 ? nthreads : detect_nthreads());
+    }
+    fprintf(stderr, "Usage: %s -c infile outfolder|out.pbwtp blsize_for_bwt nparts_per_mblock max_mblock_size nthreads [ac|rc|huf [chunk_size]]\n"
+                    "       %s -d infolder|in.pbwtp outfile block_size nthreads\n"
+                    "       %s -x infolder|in.pbwtp outfile block_size offset length nthreads\n",
+            argv[0], argv[0], argv[0]);
+    return 1;
+}
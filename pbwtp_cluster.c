@@ -0,0 +1,376 @@
+//
+//  pbwtp_cluster.c
+//  Groups blocks of the BWT output by similarity, as splitf_in_mblocks1.py: k-means on
+//  their byte histograms (k-means++ seeding, Lloyd iterations on nthreads threads), a
+//  mini-batch step for blocks arriving later, and the packing of the clusters under a
+//  maximum megablock size of group_blocks_by_similarity(). Used by splitf_in_mblocks2
+//  and pbwtp -c.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "libpbwtp.h"
+
+#define NO_OF_CHARS PBWTP_HIST_SIZE
+// Lloyd iterations, stopped earlier once no block changes cluster (sklearn: max_iter=300)
+#define KMEANS_MAX_ITER 300
+
+// work of one thread: blocks [first, last) of hist
+typedef struct {
+    pbwtp_kmeans *km;
+    const float *hist;
+    int *labels;
+    float *dist;
+    int nblocks;
+    int seed_center;   // newest center of the k-means++ seeding
+    int tid;
+    int changed;
+} KmeansArg;
+
+
+// fixed seed, so a split can be repeated (the Python version draws from random)
+static unsigned long long rng_next(pbwtp_kmeans *km)
+{
+    km->rng ^= km->rng << 13;
+    km->rng ^= km->rng >> 7;
+    km->rng ^= km->rng << 17;
+    return km->rng;
+}
+
+// runs fn on km->nthreads copies of *arg and waits for them
+static int run_threads(const KmeansArg *arg, KmeansArg *args, void *(*fn)(void *))
+{
+    pthread_t threads[PBWTP_KMEANS_MAX_THREADS];
+    int t, nthreads = arg->km->nthreads, rc = 0;
+
+    for (t = 0; t < nthreads; t++) {
+        args[t] = *arg;
+        args[t].tid = t;
+        if (pthread_create(&threads[t], NULL, fn, &args[t])) {
+            nthreads = t;
+            rc = -1;
+            break;
+        }
+    }
+    for (t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+    return rc;
+}
+
+static void thread_range(const KmeansArg *a, int *first, int *last)
+{
+    *first = (int)((long long)a->nblocks * a->tid / a->km->nthreads);
+    *last = (int)((long long)a->nblocks * (a->tid + 1) / a->km->nthreads);
+}
+
+
+//------------------------------------------------------------
+// Byte histograms
+
+/* Counting into four tables in turn keeps consecutive equal bytes, which are frequent
+ * after the BWT, from waiting on each other's increment; 8 bytes are loaded at once. */
+void pbwtp_byte_histogram(const unsigned char *p, size_t n, float *hist)
+{
+    unsigned int count[4][NO_OF_CHARS];
+    unsigned long long w;
+    size_t i = 0;
+    int c;
+
+    memset(count, 0, sizeof(count));
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&w, p + i, 8);
+        count[0][w & 0xff]++;
+        count[1][(w >> 8) & 0xff]++;
+        count[2][(w >> 16) & 0xff]++;
+        count[3][(w >> 24) & 0xff]++;
+        count[0][(w >> 32) & 0xff]++;
+        count[1][(w >> 40) & 0xff]++;
+        count[2][(w >> 48) & 0xff]++;
+        count[3][w >> 56]++;
+    }
+    for (; i < n; i++)
+        count[0][p[i]]++;
+    for (c = 0; c < NO_OF_CHARS; c++)
+        hist[c] = (float)(count[0][c] + count[1][c] + count[2][c] + count[3][c]);
+}
+
+
+//------------------------------------------------------------
+// k-means on the histograms
+
+static inline float distance2(const float *x, const float *c)
+{
+#ifdef __SSE2__
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), d0, d1;
+    float part[4];
+    int i;
+
+    for (i = 0; i < NO_OF_CHARS; i += 8) {
+        d0 = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(c + i));
+        d1 = _mm_sub_ps(_mm_loadu_ps(x + i + 4), _mm_loadu_ps(c + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(d0, d0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(d1, d1));
+    }
+    _mm_storeu_ps(part, _mm_add_ps(acc0, acc1));
+    return part[0] + part[1] + part[2] + part[3];
+#else
+    float d, sum = 0;
+    int i;
+
+    for (i = 0; i < NO_OF_CHARS; i++) {
+        d = x[i] - c[i];
+        sum += d * d;
+    }
+    return sum;
+#endif
+}
+
+// k-means++ seeding: distance of every block to the nearest of the centers so far
+static void *seed_thread(void *arg)
+{
+    KmeansArg *a = (KmeansArg *)arg;
+    const float *c = a->km->centers + (size_t)a->seed_center * NO_OF_CHARS;
+    float d;
+    int i, first, last;
+
+    thread_range(a, &first, &last);
+    for (i = first; i < last; i++) {
+        d = distance2(a->hist + (size_t)i * NO_OF_CHARS, c);
+        if (d < a->dist[i])
+            a->dist[i] = d;
+    }
+    return NULL;
+}
+
+static int kmeans_seed(KmeansArg *arg, KmeansArg *args)
+{
+    pbwtp_kmeans *km = arg->km;
+    double total, pick;
+    int i, k;
+
+    for (i = 0; i < arg->nblocks; i++)
+        arg->dist[i] = FLT_MAX;
+    i = (int)(rng_next(km) % arg->nblocks);
+    for (k = 0; k < km->nclusters; k++) {
+        memcpy(km->centers + (size_t)k * NO_OF_CHARS, arg->hist + (size_t)i * NO_OF_CHARS, NO_OF_CHARS * sizeof(float));
+        if (k + 1 == km->nclusters)
+            break;
+        arg->seed_center = k;
+        if (run_threads(arg, args, seed_thread))
+            return -1;
+        // next center with probability proportional to the squared distance
+        total = 0;
+        for (i = 0; i < arg->nblocks; i++)
+            total += arg->dist[i];
+        pick = total * (double)(rng_next(km) >> 11) / (double)(1ull << 53);
+        for (i = 0; i < arg->nblocks - 1 && (pick -= arg->dist[i]) >= 0; i++);
+    }
+    return 0;
+}
+
+// assigns the blocks of a thread to their nearest center and sums them per cluster
+static void *assign_thread(void *arg)
+{
+    KmeansArg *a = (KmeansArg *)arg;
+    pbwtp_kmeans *km = a->km;
+    size_t stride = (size_t)km->nclusters * (NO_OF_CHARS + 1);
+    double *sum = km->sums + stride * a->tid, *count = sum + (size_t)km->nclusters * NO_OF_CHARS;
+    const float *x;
+    float d, best;
+    int i, k, c, label, first, last;
+
+    memset(sum, 0, stride * sizeof(double));
+    a->changed = 0;
+    thread_range(a, &first, &last);
+    for (i = first; i < last; i++) {
+        x = a->hist + (size_t)i * NO_OF_CHARS;
+        best = FLT_MAX;
+        label = 0;
+        for (k = 0; k < km->nclusters; k++) {
+            d = distance2(x, km->centers + (size_t)k * NO_OF_CHARS);
+            if (d < best) {
+                best = d;
+                label = k;
+            }
+        }
+        if (label != a->labels[i]) {
+            a->labels[i] = label;
+            a->changed = 1;
+        }
+        for (c = 0; c < NO_OF_CHARS; c++)
+            sum[(size_t)label * NO_OF_CHARS + c] += x[c];
+        count[label] += 1;
+    }
+    return NULL;
+}
+
+// adds the per thread sums of assign_thread() into the first ones
+static double *reduce_sums(pbwtp_kmeans *km)
+{
+    size_t stride = (size_t)km->nclusters * (NO_OF_CHARS + 1), k;
+    int t;
+
+    for (t = 1; t < km->nthreads; t++)
+        for (k = 0; k < stride; k++)
+            km->sums[k] += km->sums[stride * t + k];
+    return km->sums;
+}
+
+int pbwtp_kmeans_init(pbwtp_kmeans *km, int nclusters, int nthreads)
+{
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > PBWTP_KMEANS_MAX_THREADS)
+        nthreads = PBWTP_KMEANS_MAX_THREADS;
+    km->nclusters = nclusters > 0 ? nclusters : 1;
+    km->nthreads = nthreads;
+    km->rng = 0x9e3779b97f4a7c15ull;
+    km->centers = (float *)malloc((size_t)km->nclusters * NO_OF_CHARS * sizeof(float));
+    km->count = (double *)calloc(km->nclusters, sizeof(double));
+    km->sums = (double *)malloc((size_t)nthreads * km->nclusters * (NO_OF_CHARS + 1) * sizeof(double));
+    if (km->centers == NULL || km->count == NULL || km->sums == NULL) {
+        pbwtp_kmeans_free(km);
+        return -1;
+    }
+    return 0;
+}
+
+void pbwtp_kmeans_free(pbwtp_kmeans *km)
+{
+    free(km->centers);
+    free(km->count);
+    free(km->sums);
+    km->centers = NULL;
+    km->count = NULL;
+    km->sums = NULL;
+}
+
+int pbwtp_kmeans_fit(pbwtp_kmeans *km, const float *hist, int nblocks, int *labels)
+{
+    KmeansArg arg, args[PBWTP_KMEANS_MAX_THREADS];
+    double *sum, count;
+    int iter, t, k, c, changed;
+
+    if (nblocks <= 0)
+        return 0;
+    if (km->nclusters > nblocks)
+        km->nclusters = nblocks;
+    memset(&arg, 0, sizeof(arg));
+    arg.km = km;
+    arg.hist = hist;
+    arg.labels = labels;
+    arg.nblocks = nblocks;
+    arg.dist = (float *)malloc(nblocks * sizeof(float));
+    if (arg.dist == NULL || kmeans_seed(&arg, args)) {
+        free(arg.dist);
+        return -1;
+    }
+    free(arg.dist);
+    arg.dist = NULL;
+
+    for (k = 0; k < nblocks; k++)
+        labels[k] = -1;
+    for (iter = 0; iter < KMEANS_MAX_ITER; iter++) {
+        if (run_threads(&arg, args, assign_thread))
+            return -1;
+        changed = 0;
+        for (t = 0; t < km->nthreads; t++)
+            changed |= args[t].changed;
+        if (!changed)
+            break;
+        // new centers from the per thread sums; an empty cluster keeps its center
+        sum = reduce_sums(km);
+        for (k = 0; k < km->nclusters; k++) {
+            count = sum[(size_t)km->nclusters * NO_OF_CHARS + k];
+            if (count > 0)
+                for (c = 0; c < NO_OF_CHARS; c++)
+                    km->centers[(size_t)k * NO_OF_CHARS + c] = (float)(sum[(size_t)k * NO_OF_CHARS + c] / count);
+        }
+    }
+    for (k = 0; k < km->nclusters; k++)
+        km->count[k] = 0;
+    for (k = 0; k < nblocks; k++)
+        km->count[labels[k]] += 1;
+    return 0;
+}
+
+int pbwtp_kmeans_update(pbwtp_kmeans *km, const float *hist, int nblocks, int *labels)
+{
+    KmeansArg arg, args[PBWTP_KMEANS_MAX_THREADS];
+    double *sum, n;
+    int i, k, c;
+
+    if (nblocks <= 0)
+        return 0;
+    memset(&arg, 0, sizeof(arg));
+    arg.km = km;
+    arg.hist = hist;
+    arg.labels = labels;
+    arg.nblocks = nblocks;
+    for (i = 0; i < nblocks; i++)
+        labels[i] = -1;
+    if (run_threads(&arg, args, assign_thread))
+        return -1;
+    sum = reduce_sums(km);
+    for (k = 0; k < km->nclusters; k++) {
+        n = sum[(size_t)km->nclusters * NO_OF_CHARS + k];
+        if (n == 0)
+            continue;
+        for (c = 0; c < NO_OF_CHARS; c++)
+            km->centers[(size_t)k * NO_OF_CHARS + c] = (float)((km->centers[(size_t)k * NO_OF_CHARS + c] * km->count[k] +
+                                                                sum[(size_t)k * NO_OF_CHARS + c]) / (km->count[k] + n));
+        km->count[k] += n;
+    }
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// Packing
+
+/* group_blocks_by_similarity(): a block whose cluster would exceed max_size goes to the
+ * first of the k-means clusters with room, or else to a new cluster of its own */
+int pbwtp_pack_clusters(int *labels, const size_t *size, int nblocks, int nclusters, size_t max_size)
+{
+    size_t *group_size, *grown;
+    int i, g, label, ngroups = nclusters, capacity = nclusters > 0 ? nclusters : 1, numbered = 0;
+
+    group_size = (size_t *)calloc(capacity, sizeof(size_t));
+    if (group_size == NULL)
+        return -1;
+    for (i = 0; i < nblocks; i++) {
+        label = labels[i];
+        if (group_size[label] + size[i] > max_size) {
+            for (g = 0; g < nclusters && group_size[g] + size[i] > max_size; g++);
+            if (g == nclusters) {
+                if (ngroups == capacity) {
+                    capacity *= 2;
+                    grown = (size_t *)realloc(group_size, capacity * sizeof(size_t));
+                    if (grown == NULL) {
+                        free(group_size);
+                        return -1;
+                    }
+                    group_size = grown;
+                }
+                g = ngroups++;
+                group_size[g] = 0;
+            }
+            label = g;
+        }
+        labels[i] = label;
+        group_size[label] += size[i];
+    }
+
+    // empty clusters make no megablock, the others are numbered in cluster order
+    for (g = 0; g < ngroups; g++)
+        group_size[g] = group_size[g] ? (size_t)numbered++ : (size_t)-1;
+    for (i = 0; i < nblocks; i++)
+        labels[i] = (int)group_size[labels[i]];
+    free(group_size);
+    return numbered;
+}
@@ -0,0 +1,219 @@
+//
+//  pbwtp_meta.c
+//  Reads and writes the metadata.json megablock map written by splitf_in_mblocks1.py
+//  and read by reconstruct_from_mblocks1.py.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "libpbwtp.h"
+
+
+void pbwtp_meta_init(pbwtp_metadata *meta)
+{
+    meta->megablocks = NULL;
+    meta->nmegablocks = 0;
+    meta->codec = PBWTP_CODEC_AC;
+    meta->chunk_size = 0;
+    meta->zle = 0;
+    meta->bwt_blocks = 0;
+}
+
+void pbwtp_meta_free(pbwtp_metadata *meta)
+{
+    int i;
+
+    for (i = 0; i < meta->nmegablocks; i++) {
+        free(meta->megablocks[i].file);
+        free(meta->megablocks[i].blocks);
+    }
+    free(meta->megablocks);
+    pbwtp_meta_init(meta);
+}
+
+pbwtp_megablock *pbwtp_meta_add_megablock(pbwtp_metadata *meta, const char *file)
+{
+    pbwtp_megablock *mb;
+    const char *p;
+
+    mb = (pbwtp_megablock *)realloc(meta->megablocks, (meta->nmegablocks + 1) * sizeof(pbwtp_megablock));
+    if (mb == NULL)
+        return NULL;
+    meta->megablocks = mb;
+    mb = &meta->megablocks[meta->nmegablocks];
+    memset(mb, 0, sizeof(*mb));
+    mb->file = strdup(file);
+    if (mb->file == NULL)
+        return NULL;
+    meta->nmegablocks++;
+
+    // megablock_<key>.dat is compressed to comp_<key>.bzp
+    mb->key = -1;
+    for (p = file + strlen(file); p > file && !isdigit((unsigned char)p[-1]); p--);
+    while (p > file && isdigit((unsigned char)p[-1]))
+        p--;
+    if (isdigit((unsigned char)*p))
+        mb->key = atoi(p);
+    return mb;
+}
+
+int pbwtp_meta_add_block(pbwtp_megablock *mb, size_t position, size_t size)
+{
+    pbwtp_block_pos *blocks;
+
+    if (mb->nblocks == mb->capacity) {
+        int capacity = mb->capacity ? 2 * mb->capacity : 16;
+        blocks = (pbwtp_block_pos *)realloc(mb->blocks, capacity * sizeof(pbwtp_block_pos));
+        if (blocks == NULL)
+            return -1;
+        mb->blocks = blocks;
+        mb->capacity = capacity;
+    }
+    mb->blocks[mb->nblocks].position = position;
+    mb->blocks[mb->nblocks].size = size;
+    mb->nblocks++;
+    mb->raw_size += size;
+    return 0;
+}
+
+
+/* Copies the JSON string starting after the opening quote at *pp into dst (at most
+ * cap-1 bytes) and leaves *pp after the closing quote. Escapes are kept verbatim except
+ * for \" and \\ which are all a file name can need. */
+static int json_string(const char **pp, char *dst, size_t cap)
+{
+    const char *p = *pp;
+    size_t len = 0;
+
+    while (*p && *p != '"') {
+        if (*p == '\\' && p[1])
+            p++;
+        if (len + 1 < cap)
+            dst[len++] = *p;
+        p++;
+    }
+    if (*p != '"')
+        return -1;
+    dst[len] = '\0';
+    *pp = p + 1;
+    return 0;
+}
+
+int pbwtp_meta_read(const char *path, pbwtp_metadata *meta)
+{
+    FILE *fp = fopen(path, "rb");
+    char *text, *end, key[64], value[4096];
+    const char *p;
+    long len;
+    pbwtp_megablock *mb = NULL;
+    size_t position = 0;
+    int have_position = 0;
+
+    pbwtp_meta_init(meta);
+    if (fp == NULL)
+        return -1;
+    fseek(fp, 0L, SEEK_END);
+    len = ftell(fp);
+    rewind(fp);
+    text = (char *)malloc(len + 1);
+    if (text == NULL || fread(text, 1, len, fp) != (size_t)len) {
+        free(text);
+        fclose(fp);
+        return -1;
+    }
+    text[len] = '\0';
+    fclose(fp);
+
+    // The schema is fixed, so a flat scan for "key": value pairs is enough: a new
+    // megablock starts at each megablock_file, a block at each position.
+    for (p = text; *p; ) {
+        if (*p != '"') {
+            p++;
+            continue;
+        }
+        p++;
+        if (json_string(&p, key, sizeof(key)))
+            goto fail;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p != ':')
+            continue;
+        p++;
+        while (isspace((unsigned char)*p))
+            p++;
+
+        if (*p == '"') {
+            p++;
+            if (json_string(&p, value, sizeof(value)))
+                goto fail;
+            if (strcmp(key, "megablock_file") == 0) {
+                mb = pbwtp_meta_add_megablock(meta, value);
+                if (mb == NULL)
+                    goto fail;
+            } else if (strcmp(key, "codec") == 0) {
+                meta->codec = pbwtp_codec_from_name(value);
+                if (meta->codec < 0)
+                    goto fail;
+            }
+        } else if (isdigit((unsigned char)*p)) {
+            unsigned long long number = strtoull(p, &end, 10);
+            p = end;
+            if (strcmp(key, "position") == 0) {
+                position = (size_t)number;
+                have_position = 1;
+            } else if (strcmp(key, "chunk_size") == 0) {
+                meta->chunk_size = (size_t)number;
+            } else if (strcmp(key, "zle") == 0) {
+                meta->zle = number != 0;
+            } else if (strcmp(key, "bwt_blocks") == 0) {
+                meta->bwt_blocks = number != 0;
+            } else if (strcmp(key, "size") == 0 && have_position) {
+                if (mb == NULL || pbwtp_meta_add_block(mb, position, (size_t)number))
+                    goto fail;
+                have_position = 0;
+            }
+        }
+    }
+    free(text);
+    return 0;
+
+fail:
+    free(text);
+    pbwtp_meta_free(meta);
+    return -1;
+}
+
+int pbwtp_meta_write(const char *path, const pbwtp_metadata *meta)
+{
+    FILE *fp = fopen(path, "w");
+    int i, j;
+
+    if (fp == NULL)
+        return -1;
+    // same layout as json.dump(metadata, f, indent=4); the Python tools only know
+    // unchunked AC archives, so the codec and chunk_size keys are left out for them
+    fprintf(fp, "{\n");
+    if (meta->zle)
+        fprintf(fp, "    \"zle\": 1,\n");
+    if (meta->bwt_blocks)
+        fprintf(fp, "    \"bwt_blocks\": 1,\n");
+    if (meta->codec != PBWTP_CODEC_AC)
+        fprintf(fp, "    \"codec\": \"%s\",\n", pbwtp_codec_name(meta->codec));
+    if (meta->chunk_size)
+        fprintf(fp, "    \"chunk_size\": %zu,\n", meta->chunk_size);
+    fprintf(fp, "    \"megablocks\": [");
+    for (i = 0; i < meta->nmegablocks; i++) {
+        const pbwtp_megablock *mb = &meta->megablocks[i];
+        fprintf(fp, "%s\n        {\n            \"megablock_file\": \"%s\",\n"
+                "            \"block_positions\": [", i ? "," : "", mb->file);
+        for (j = 0; j < mb->nblocks; j++)
+            fprintf(fp, "%s\n                {\n                    \"position\": %zu,\n"
+                    "                    \"size\": %zu\n                }",
+                    j ? "," : "", mb->blocks[j].position, mb->blocks[j].size);
+        fprintf(fp, "%s]\n        }", mb->nblocks ? "\n            " : "");
+    }
+    fprintf(fp, "%s]\n}", meta->nmegablocks ? "\n    " : "");
+    return fclose(fp) ? -1 : 0;
+}
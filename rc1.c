@@ -0,0 +1,71 @@
+//
+//  rc1.c
+//  Range coder counterpart of arith_adapt1.c for the last stage of the chain: adaptive
+//  binary context modeling of the RLE'd MTF ranks with byte-wise renormalization
+//  (pbwtp_rc_encode / pbwtp_rc_decode of libpbwtp).
+//  Usage:
+//    rc1 e(ncode)|d(ecode) infile outfile
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "libpbwtp.h"
+
+
+static int read_all(const char *path, pbwtp_buf *buf)
+{
+    FILE *fp = fopen(path, "rb");
+    size_t n;
+
+    if (fp == NULL)
+        return -1;
+    do {
+        if (pbwtp_buf_reserve(buf, 1 << 20)) {
+            fclose(fp);
+            return -1;
+        }
+        n = fread(buf->data + buf->size, 1, 1 << 20, fp);
+        buf->size += n;
+    } while (n > 0);
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    pbwtp_buf in, out;
+    pbwtp_ctx *ctx;
+    FILE *fp;
+    int rc;
+
+    if (argc < 4 || (argv[1][0] != 'e' && argv[1][0] != 'd')) {
+        printf("\nUsage: rc1 e|d infile outfile\n");
+        exit(1);
+    }
+    pbwtp_buf_init(&in);
+    pbwtp_buf_init(&out);
+    if (read_all(argv[2], &in)) {
+        printf("\nCannot read input file %s\n", argv[2]);
+        exit(1);
+    }
+    ctx = pbwtp_ctx_new();
+    if (ctx == NULL)
+        exit(1);
+    if (argv[1][0] == 'e')
+        rc = pbwtp_rc_encode(ctx, in.data, in.size, &out);
+    else
+        rc = pbwtp_rc_decode(ctx, in.data, in.size, &out);
+    if (rc) {
+        printf("\n%s failed on %s\n", argv[1][0] == 'e' ? "Encoding" : "Decoding", argv[2]);
+        exit(1);
+    }
+    fp = fopen(argv[3], "wb");
+    if (fp == NULL || fwrite(out.data, 1, out.size, fp) != out.size || fclose(fp)) {
+        printf("\nCannot write output file %s\n", argv[3]);
+        exit(1);
+    }
+    pbwtp_ctx_free(ctx);
+    pbwtp_buf_free(&in);
+    pbwtp_buf_free(&out);
+    return 0;
+}
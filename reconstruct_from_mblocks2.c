@@ -0,0 +1,206 @@
+//
+//  reconstruct_from_mblocks2.c
+//  Native version of reconstruct_from_mblocks1.py: puts the BWT output back together from
+//  the megablock files listed in metadata.json. The output is preallocated with fallocate,
+//  then nthreads workers (default: CPU count) take one megablock at a time and copy each
+//  of its blocks to its position with copy_file_range, so the data stays in the kernel;
+//  where that is not supported (other file system, old kernel) pread / pwrite are used.
+//  Usage:
+//    reconstruct_from_mblocks2 output_dir output_file [nthreads]
+//
+
+#define _GNU_SOURCE // copy_file_range, fallocate
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "libpbwtp.h"
+
+#define MAX_THREADS 64
+#define MAX_PATH 4096
+// buffer of the pread / pwrite fallback
+#define COPY_BUF_SIZE (1 << 20)
+
+typedef struct {
+    const pbwtp_metadata *meta;
+    int out_fd;
+    int next, failed;
+    pthread_mutex_t lock;
+} Scatter;
+
+
+static int detect_nthreads(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return (ncpu > 0) ? (int)ncpu : 1;
+}
+
+// copies n bytes at in_off of in_fd to out_off of out_fd through buf
+static int copy_buffered(int in_fd, off_t in_off, int out_fd, off_t out_off, size_t n, unsigned char *buf) {
+    ssize_t r, w;
+    size_t done;
+
+    while (n > 0) {
+        r = pread(in_fd, buf, n < COPY_BUF_SIZE ? n : COPY_BUF_SIZE, in_off);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return -1;
+        for (done = 0; done < (size_t)r; done += (size_t)w) {
+            w = pwrite(out_fd, buf + done, (size_t)r - done, out_off + (off_t)done);
+            if (w < 0 && errno == EINTR) {
+                w = 0;
+                continue;
+            }
+            if (w <= 0)
+                return -1;
+        }
+        in_off += r;
+        out_off += r;
+        n -= (size_t)r;
+    }
+    return 0;
+}
+
+/* Copies a block with copy_file_range. Returns 1 when the kernel or the file systems do
+ * not support it before anything was copied, so the caller falls back to copy_buffered(). */
+static int copy_block(int in_fd, off_t in_off, int out_fd, off_t out_off, size_t n) {
+    ssize_t c;
+    int first = 1;
+
+    while (n > 0) {
+        c = copy_file_range(in_fd, &in_off, out_fd, &out_off, n, 0);
+        if (c < 0 && errno == EINTR)
+            continue;
+        if (c < 0 && first && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            return 1;
+        if (c <= 0)
+            return -1;
+        first = 0;
+        n -= (size_t)c;
+    }
+    return 0;
+}
+
+// blocks of one megablock, stored one after the other in its file
+static int scatter_megablock(const pbwtp_megablock *mb, int out_fd, unsigned char **buf) {
+    off_t in_off = 0;
+    int in_fd, j, rc = 0;
+
+    in_fd = open(mb->file, O_RDONLY);
+    if (in_fd < 0) {
+        perror(mb->file);
+        return -1;
+    }
+    for (j = 0; j < mb->nblocks && rc >= 0; j++) {
+        rc = (*buf == NULL) ? copy_block(in_fd, in_off, out_fd, (off_t)mb->blocks[j].position, mb->blocks[j].size) : 1;
+        if (rc == 1) {
+            if (*buf == NULL && (*buf = (unsigned char *)malloc(COPY_BUF_SIZE)) == NULL)
+                rc = -1;
+            else
+                rc = copy_buffered(in_fd, in_off, out_fd, (off_t)mb->blocks[j].position, mb->blocks[j].size, *buf);
+        }
+        in_off += (off_t)mb->blocks[j].size;
+    }
+    if (rc < 0)
+        perror(mb->file);
+    close(in_fd);
+    return rc < 0 ? -1 : 0;
+}
+
+static void *scatter_thread(void *arg) {
+    Scatter *sc = (Scatter *)arg;
+    unsigned char *buf = NULL;  // allocated once copy_file_range is found not to work
+    int m;
+
+    for (;;) {
+        pthread_mutex_lock(&sc->lock);
+        m = sc->failed ? sc->meta->nmegablocks : sc->next++;
+        pthread_mutex_unlock(&sc->lock);
+        if (m >= sc->meta->nmegablocks)
+            break;
+        if (scatter_megablock(&sc->meta->megablocks[m], sc->out_fd, &buf)) {
+            pthread_mutex_lock(&sc->lock);
+            sc->failed = 1;
+            pthread_mutex_unlock(&sc->lock);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+
+//------------------------------------------------------------
+// main command line inputs
+int main(int argc, char *argv[])
+{
+    pbwtp_metadata meta;
+    pthread_t threads[MAX_THREADS];
+    char path[MAX_PATH];
+    size_t len, total = 0, end;
+    int nthreads, m, j, t, rc;
+    Scatter sc;
+
+    if (argc != 3 && argc != 4) {
+        printf("Usage: %s <output_dir> <output_file> [nthreads]\n", argv[0]);
+        return 1;
+    }
+    nthreads = (argc == 4) ? atoi(argv[3]) : detect_nthreads();
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+
+    len = strlen(argv[1]);
+    snprintf(path, MAX_PATH, "%s%smetadata.json", argv[1], (len && argv[1][len - 1] == '/') ? "" : "/");
+    if (pbwtp_meta_read(path, &meta)) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return 1;
+    }
+    for (m = 0; m < meta.nmegablocks; m++)
+        for (j = 0; j < meta.megablocks[m].nblocks; j++) {
+            end = meta.megablocks[m].blocks[j].position + meta.megablocks[m].blocks[j].size;
+            if (end > total)
+                total = end;
+        }
+    if (nthreads > meta.nmegablocks)
+        nthreads = meta.nmegablocks > 0 ? meta.nmegablocks : 1;
+
+    // the whole output is allocated up front, so the workers write into existing extents
+    sc.out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (sc.out_fd < 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    if (total > 0 && fallocate(sc.out_fd, 0, 0, (off_t)total) && ftruncate(sc.out_fd, (off_t)total)) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    sc.meta = &meta;
+    sc.next = 0;
+    sc.failed = 0;
+    pthread_mutex_init(&sc.lock, NULL);
+    for (t = 0; t < nthreads; t++)
+        if (pthread_create(&threads[t], NULL, scatter_thread, &sc)) {
+            perror("pthread_create");
+            return 1;
+        }
+    for (t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+    pthread_mutex_destroy(&sc.lock);
+
+    rc = sc.failed;
+    if (close(sc.out_fd)) {
+        perror(argv[2]);
+        rc = 1;
+    }
+    pbwtp_meta_free(&meta);
+    if (rc)
+        return 1;
+    printf("Reconstruction complete. Output saved to %s\n", argv[2]);
+    return 0;
+}
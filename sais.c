@@ -0,0 +1,196 @@
+//
+//  sais.c
+//  Suffix array construction by induced sorting (Nong, Zhang & Chan, 2009)
+//  with a virtual sentinel, so the input buffer never needs an extra byte.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "sais.h"
+
+// character access for the byte input (cs == 1) and the reduced int strings (cs == 4)
+#define chr(i) (cs == sizeof(int) ? ((const int *)s)[i] : ((const unsigned char *)s)[i])
+
+// type bitmap: 1 for S-type, 0 for L-type suffixes
+#define tget(i) ((t[(i) >> 3] >> ((i) & 7)) & 1)
+#define tset(i, b) ((b) ? (t[(i) >> 3] |= (unsigned char)(1 << ((i) & 7))) \
+                        : (t[(i) >> 3] &= (unsigned char)~(1 << ((i) & 7))))
+#define isLMS(i) ((i) > 0 && tget(i) && !tget((i) - 1))
+
+
+/* Computes the start (end = 0) or one-past-end (end = 1) of each character bucket. */
+static void get_buckets(const void *s, int *bkt, int n, int K, int cs, int end)
+{
+    int i, sum = 0;
+
+    memset(bkt, 0, K * sizeof(int));
+    for (i = 0; i < n; i++)
+        bkt[chr(i)]++;
+    for (i = 0; i < K; i++) {
+        sum += bkt[i];
+        bkt[i] = end ? sum : sum - bkt[i];
+    }
+}
+
+/* Induces L-type suffixes from the sorted LMS (or S-type) suffixes. The virtual sentinel
+ * is the smallest suffix, so suffix n-1 (always L-type) is induced from it first. */
+static void induce_L(const unsigned char *t, int *SA, const void *s, int *bkt, int n, int K, int cs)
+{
+    int i, j;
+
+    get_buckets(s, bkt, n, K, cs, 0);
+    SA[bkt[chr(n - 1)]++] = n - 1;
+    for (i = 0; i < n; i++) {
+        j = SA[i] - 1;
+        if (SA[i] > 0 && !tget(j))
+            SA[bkt[chr(j)]++] = j;
+    }
+}
+
+/* Induces S-type suffixes from the sorted L-type suffixes, scanning right to left. */
+static void induce_S(const unsigned char *t, int *SA, const void *s, int *bkt, int n, int K, int cs)
+{
+    int i, j;
+
+    get_buckets(s, bkt, n, K, cs, 1);
+    for (i = n - 1; i >= 0; i--) {
+        j = SA[i] - 1;
+        if (SA[i] > 0 && tget(j))
+            SA[--bkt[chr(j)]] = j;
+    }
+}
+
+/* Recursive SA-IS on s[0..n-1] over an alphabet of size K, cs bytes per character. */
+static int sais_main(const void *s, int *SA, int n, int K, int cs)
+{
+    unsigned char *t;
+    int *bkt, *s1, *SA1;
+    int i, j, n1, name, prev, pos, d, diff;
+
+    if (n <= 0)
+        return 0;
+    if (n == 1) {
+        SA[0] = 0;
+        return 0;
+    }
+
+    t = (unsigned char *)calloc((n >> 3) + 1, 1);
+    bkt = (int *)malloc(K * sizeof(int));
+    if (!t || !bkt) {
+        free(t); free(bkt);
+        return -1;
+    }
+
+    // classify suffixes; the last one is L-type since it is followed by the sentinel
+    tset(n - 1, 0);
+    for (i = n - 2; i >= 0; i--)
+        tset(i, chr(i) < chr(i + 1) || (chr(i) == chr(i + 1) && tget(i + 1)));
+
+    // stage 1: sort the LMS substrings by placing them at their bucket ends and inducing
+    get_buckets(s, bkt, n, K, cs, 1);
+    for (i = 0; i < n; i++)
+        SA[i] = -1;
+    for (i = 1; i < n; i++)
+        if (isLMS(i))
+            SA[--bkt[chr(i)]] = i;
+    induce_L(t, SA, s, bkt, n, K, cs);
+    induce_S(t, SA, s, bkt, n, K, cs);
+
+    // compact the sorted LMS substrings into the first n1 slots
+    for (n1 = 0, i = 0; i < n; i++)
+        if (isLMS(SA[i]))
+            SA[n1++] = SA[i];
+
+    // name the LMS substrings; substrings running into the sentinel are always unique
+    for (i = n1; i < n; i++)
+        SA[i] = -1;
+    for (name = 0, prev = -1, i = 0; i < n1; i++) {
+        pos = SA[i];
+        diff = 0;
+        for (d = 0; d < n; d++) {
+            if (prev == -1 || pos + d == n || prev + d == n ||
+                chr(pos + d) != chr(prev + d) || tget(pos + d) != tget(prev + d)) {
+                diff = 1;
+                break;
+            } else if (d > 0 && (isLMS(pos + d) || isLMS(prev + d))) {
+                break;
+            }
+        }
+        if (diff) {
+            name++;
+            prev = pos;
+        }
+        SA[n1 + (pos >> 1)] = name - 1;
+    }
+    for (i = n - 1, j = n - 1; i >= n1; i--)
+        if (SA[i] >= 0)
+            SA[j--] = SA[i];
+
+    // stage 2: sort the reduced string, recursing while names are not yet unique
+    s1 = SA + n - n1;
+    SA1 = SA;
+    if (name < n1) {
+        if (sais_main(s1, SA1, n1, name, sizeof(int))) {
+            free(t); free(bkt);
+            return -1;
+        }
+    } else {
+        for (i = 0; i < n1; i++)
+            SA1[s1[i]] = i;
+    }
+
+    // stage 3: induce the full suffix array from the sorted LMS suffixes
+    get_buckets(s, bkt, n, K, cs, 1);
+    for (i = 1, j = 0; i < n; i++)
+        if (isLMS(i))
+            s1[j++] = i;
+    for (i = 0; i < n1; i++)
+        SA1[i] = s1[SA1[i]];
+    for (i = n1; i < n; i++)
+        SA[i] = -1;
+    for (i = n1 - 1; i >= 0; i--) {
+        j = SA[i];
+        SA[i] = -1;
+        SA[--bkt[chr(j)]] = j;
+    }
+    induce_L(t, SA, s, bkt, n, K, cs);
+    induce_S(t, SA, s, bkt, n, K, cs);
+
+    free(t);
+    free(bkt);
+    return 0;
+}
+
+
+int sais_sort(const unsigned char *T, int *SA, int n)
+{
+    if (!T || !SA || n < 0)
+        return -1;
+    return sais_main(T, SA, n, 256, sizeof(unsigned char));
+}
+
+
+/* bounded_compare() treats the end of the buffer as a character bigger than any byte.
+ * Complementing every byte reverses the byte order, and reversing the resulting standard
+ * suffix array (where the end sorts first) gives exactly that order for suffixes 0..n-1.
+ * The empty suffix n compares bigger than everything else and goes last. */
+int sais_bwt_order(unsigned char *buff, int *inds, int n)
+{
+    int i, tmp, rc;
+
+    for (i = 0; i < n; i++)
+        buff[i] = (unsigned char)~buff[i];
+    rc = sais_sort(buff, inds, n);
+    for (i = 0; i < n; i++)
+        buff[i] = (unsigned char)~buff[i];
+    if (rc)
+        return rc;
+
+    for (i = 0; i < n / 2; i++) {
+        tmp = inds[i];
+        inds[i] = inds[n - 1 - i];
+        inds[n - 1 - i] = tmp;
+    }
+    inds[n] = n;
+    return 0;
+}
@@ -0,0 +1,22 @@
+//
+//  sais.h
+//  Linear time suffix array construction (SA-IS) used by the BWT stage
+//
+
+#ifndef SAIS_H
+#define SAIS_H
+
+/* Builds the suffix array of T[0..n-1] into SA[0..n-1] in O(n) time and O(1) extra
+ * memory per recursion level (besides a type bitmap). Suffixes are ordered with the
+ * usual convention that a proper prefix sorts before the longer suffix.
+ * Returns 0 on success, -1 on allocation failure. */
+int sais_sort(const unsigned char *T, int *SA, int n);
+
+/* Fills inds[0..n] with the rotation order used by BWTap2b.c, i.e. the order produced
+ * by qsort() with bounded_compare(): the virtual end-of-buffer character at buff+n is
+ * bigger than any byte, so a suffix that is a prefix of another sorts after it and
+ * index n is always last. buff is complemented in place while sorting and restored
+ * before returning. Returns 0 on success, -1 on allocation failure. */
+int sais_bwt_order(unsigned char *buff, int *inds, int n);
+
+#endif
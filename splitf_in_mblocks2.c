@@ -0,0 +1,637 @@
+//
+//  splitf_in_mblocks2.c
+//  Native version of splitf_in_mblocks1.py: cuts the BWT output in blocks of block_size
+//  bytes +-10%, groups the blocks by k-means on their byte histograms, packs the groups
+//  under max_megablock_size the same way as group_blocks_by_similarity() and writes them
+//  as megablock_N.dat with the same metadata.json. The histograms, the k-means steps
+//  (pbwtp_cluster.c, shared with pbwtp -c) and the megablock writes run on nthreads
+//  threads (default: CPU count). With -s the input is
+//  not held in memory: blocks are clustered and written batch by batch (stream_split()).
+//  With -H the blocks are the BWT blocks and their histograms are read from the sidecar
+//  written by exbwtap2 -H, so the BWT output is only read to write the megablocks.
+//  Usage:
+//    splitf_in_mblocks2 [-s] [-H histfile] input_file output_dir block_size num_clusters max_megablock_size [nthreads]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libpbwtp.h"
+
+#define MAX_THREADS PBWTP_KMEANS_MAX_THREADS
+#define MAX_PATH 4096
+#define NO_OF_CHARS PBWTP_HIST_SIZE
+
+// histogram sidecar of exbwtap2 -H: the magic, the number of blocks, then one HistRecord
+// per block record of the BWT output, in order
+#define HIST_MAGIC "PBWTHIST"
+typedef struct {
+    long offset;
+    long length;
+    unsigned int hist[NO_OF_CHARS];
+} HistRecord;
+
+typedef struct {
+    const unsigned char *data;  // mapped input
+    size_t *pos, *size;         // blocks
+    int nblocks;
+    float *hist;                // nblocks x 256 byte counts
+    int nclusters;
+    pbwtp_kmeans km;
+    int *labels;
+    int nthreads;
+    FILE *side;                 // -H sidecar, blocks and histograms are read from it
+    long side_left;             // records not read yet
+    // megablock writes
+    const char *output_dir;
+    int *order, *group_start, ngroups;  // blocks of the megablocks, see pack_groups()
+    int next_group, failed;
+    pthread_mutex_t lock;
+} Split;
+
+typedef struct {
+    Split *s;
+    int tid;
+} ThreadArg;
+
+
+size_t convert_to_bytes(const char *size_str) {
+    char *end;
+    double number = strtod(size_str, &end); // Extract numeric part
+
+    // Constants for units
+    const size_t KILOBYTE = 1024;
+    const size_t MEGABYTE = 1024 * 1024;
+    const size_t GIGABYTE = 1024 * 1024 * 1024;
+
+    // Identify the unit and calculate the size in bytes
+    while (*end) { // Process all unit characters
+        switch (*end++) {
+            case 'K': case 'k':
+                return (size_t)(number * KILOBYTE);
+            case 'M': case 'm':
+                return (size_t)(number * MEGABYTE);
+            case 'G': case 'g':
+                return (size_t)(number * GIGABYTE);
+            case 'B': case 'b':
+                break; // 'B' is just a marker for bytes, skip it
+            default:
+                fprintf(stderr, "Unknown unit: %c\n", *(end - 1));
+                exit(EXIT_FAILURE);
+        }
+    }
+    return (size_t)number;
+}
+
+static int detect_nthreads(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return (ncpu > 0) ? (int)ncpu : 1;
+}
+
+// fixed seed, so the cuts can be repeated (the Python version draws from random)
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ull;
+
+static unsigned long long rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// length of the next block: block_size +-10%, as the Python version
+static size_t next_cut(size_t block_size) {
+    size_t cut = block_size - (block_size + 9) / 10 + (size_t)(rng_next() % ((block_size + 9) / 10 + block_size / 10 + 1));
+
+    return cut < 1 ? 1 : cut;
+}
+
+// runs fn(s, tid) on nthreads threads and waits for them
+static int run_threads(Split *s, void *(*fn)(void *)) {
+    pthread_t threads[MAX_THREADS];
+    ThreadArg args[MAX_THREADS];
+    int t, rc = 0;
+
+    for (t = 0; t < s->nthreads; t++) {
+        args[t].s = s;
+        args[t].tid = t;
+        if (pthread_create(&threads[t], NULL, fn, &args[t])) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (t = 0; t < s->nthreads; t++)
+        rc |= pthread_join(threads[t], NULL);
+    return rc;
+}
+
+// blocks [*first, *last) of thread tid
+static void thread_range(const Split *s, int tid, int *first, int *last) {
+    *first = (int)((long long)s->nblocks * tid / s->nthreads);
+    *last = (int)((long long)s->nblocks * (tid + 1) / s->nthreads);
+}
+
+
+//------------------------------------------------------------
+// Byte histograms
+
+static void *histogram_thread(void *arg) {
+    ThreadArg *a = (ThreadArg *)arg;
+    Split *s = a->s;
+    int i, first, last;
+
+    thread_range(s, a->tid, &first, &last);
+    for (i = first; i < last; i++)
+        pbwtp_byte_histogram(s->data + s->pos[i], s->size[i], s->hist + (size_t)i * NO_OF_CHARS);
+    return NULL;
+}
+
+
+//------------------------------------------------------------
+// Packing and output
+
+/* Lists the blocks of megablock g, s->labels[i] for block i, in input order as
+ * order[group_start[g] .. group_start[g + 1] - 1]. */
+static int sort_groups(Split *s) {
+    int i, g;
+
+    s->group_start = (int *)calloc(s->ngroups + 1, sizeof(int));
+    s->order = (int *)malloc((s->nblocks + 1) * sizeof(int));
+    if (s->group_start == NULL || s->order == NULL)
+        return -1;
+    for (i = 0; i < s->nblocks; i++)
+        s->group_start[s->labels[i] + 1]++;
+    for (g = 0; g < s->ngroups; g++)
+        s->group_start[g + 1] += s->group_start[g];
+    for (i = 0; i < s->nblocks; i++)
+        s->order[s->group_start[s->labels[i]]++] = i;
+    for (g = s->ngroups; g > 0; g--)
+        s->group_start[g] = s->group_start[g - 1];
+    s->group_start[0] = 0;
+    return 0;
+}
+
+/* group_blocks_by_similarity(), see pbwtp_pack_clusters() */
+static int pack_groups(Split *s, size_t max_size) {
+    s->ngroups = pbwtp_pack_clusters(s->labels, s->size, s->nblocks, s->km.nclusters, max_size);
+    return s->ngroups < 0 ? -1 : sort_groups(s);
+}
+
+static void megablock_path(const Split *s, int g, char *path) {
+    size_t len = strlen(s->output_dir);
+    snprintf(path, MAX_PATH, "%s%smegablock_%d.dat", s->output_dir,
+             (len && s->output_dir[len - 1] == '/') ? "" : "/", g);
+}
+
+static int write_all(int fd, const unsigned char *p, size_t n) {
+    ssize_t w;
+
+    while (n > 0) {
+        w = write(fd, p, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return -1;
+        p += w;
+        n -= (size_t)w;
+    }
+    return 0;
+}
+
+static void *write_thread(void *arg) {
+    Split *s = ((ThreadArg *)arg)->s;
+    char path[MAX_PATH];
+    int g, j, fd, rc;
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        g = s->failed ? s->ngroups : s->next_group++;
+        pthread_mutex_unlock(&s->lock);
+        if (g >= s->ngroups)
+            break;
+        megablock_path(s, g, path);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        rc = fd < 0;
+        for (j = s->group_start[g]; !rc && j < s->group_start[g + 1]; j++)
+            rc = write_all(fd, s->data + s->pos[s->order[j]], s->size[s->order[j]]);
+        if (fd >= 0 && close(fd))
+            rc = 1;
+        if (rc) {
+            perror(path);
+            pthread_mutex_lock(&s->lock);
+            s->failed = 1;
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+    return NULL;
+}
+
+static int write_metadata(const Split *s) {
+    pbwtp_metadata meta;
+    pbwtp_megablock *mb;
+    char path[MAX_PATH];
+    int g, j, rc;
+
+    pbwtp_meta_init(&meta);
+    // the sidecar blocks are the BWT block records, which unbwtb -m inverts per megablock
+    meta.bwt_blocks = s->side != NULL;
+    for (g = 0; g < s->ngroups; g++) {
+        megablock_path(s, g, path);
+        mb = pbwtp_meta_add_megablock(&meta, path);
+        if (mb == NULL)
+            return -1;
+        for (j = s->group_start[g]; j < s->group_start[g + 1]; j++)
+            if (pbwtp_meta_add_block(mb, s->pos[s->order[j]], s->size[s->order[j]]))
+                return -1;
+    }
+    snprintf(path, MAX_PATH, "%s%smetadata.json", s->output_dir,
+             (strlen(s->output_dir) && s->output_dir[strlen(s->output_dir) - 1] == '/') ? "" : "/");
+    rc = pbwtp_meta_write(path, &meta);
+    pbwtp_meta_free(&meta);
+    return rc;
+}
+
+
+//------------------------------------------------------------
+// Splitting
+
+static int open_sidecar(Split *s, const char *path)
+{
+    char magic[8];
+
+    s->side = fopen(path, "rb");
+    if (s->side == NULL || fread(magic, 1, 8, s->side) != 8 || memcmp(magic, HIST_MAGIC, 8) ||
+        fread(&s->side_left, sizeof(long), 1, s->side) != 1 || s->side_left < 0) {
+        fprintf(stderr, "%s is not a histogram sidecar of exbwtap2 -H\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// next block of the sidecar, which must start at position of the input
+static int sidecar_block(Split *s, size_t position, size_t *size, float *hist)
+{
+    HistRecord r;
+    int c;
+
+    if (s->side_left == 0 || fread(&r, sizeof(r), 1, s->side) != 1 ||
+        r.offset != (long)position || r.length <= 0) {
+        fprintf(stderr, "Histogram sidecar does not match the input\n");
+        return -1;
+    }
+    s->side_left--;
+    *size = (size_t)r.length;
+    for (c = 0; c < NO_OF_CHARS; c++)
+        hist[c] = (float)r.hist[c];
+    return 0;
+}
+
+// the whole input mapped at once: k-means on all blocks, then the megablocks are written
+static int batch_split(Split *s, int fd, size_t length, size_t block_size, size_t max_size)
+{
+    size_t position, cut;
+    int capacity;
+
+    if (length > 0) {
+        s->data = (const unsigned char *)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (s->data == MAP_FAILED) {
+            perror("mmap");
+            return -1;
+        }
+        madvise((void *)s->data, length, MADV_SEQUENTIAL);
+    }
+
+    // blocks of block_size +-10%, or the BWT blocks of the sidecar with their histograms
+    capacity = 1024;
+    s->pos = (size_t *)malloc(capacity * sizeof(size_t));
+    s->size = (size_t *)malloc(capacity * sizeof(size_t));
+    if (s->side)
+        s->hist = (float *)malloc((size_t)capacity * NO_OF_CHARS * sizeof(float));
+    for (position = 0; position < length; position += cut) {
+        if (s->nblocks == capacity) {
+            capacity *= 2;
+            s->pos = (size_t *)realloc(s->pos, capacity * sizeof(size_t));
+            s->size = (size_t *)realloc(s->size, capacity * sizeof(size_t));
+            if (s->side)
+                s->hist = (float *)realloc(s->hist, (size_t)capacity * NO_OF_CHARS * sizeof(float));
+        }
+        if (s->pos == NULL || s->size == NULL || (s->side && s->hist == NULL)) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        if (s->side) {
+            if (sidecar_block(s, position, &cut, s->hist + (size_t)s->nblocks * NO_OF_CHARS))
+                return -1;
+            if (cut > length - position) {
+                fprintf(stderr, "Histogram sidecar does not match the input\n");
+                return -1;
+            }
+        } else {
+            cut = next_cut(block_size);
+            if (cut > length - position)
+                cut = length - position;
+        }
+        s->pos[s->nblocks] = position;
+        s->size[s->nblocks++] = cut;
+    }
+    if (s->side && s->side_left) {
+        fprintf(stderr, "Histogram sidecar does not match the input\n");
+        return -1;
+    }
+
+    if (s->nblocks > 0) {
+        if (s->nclusters > s->nblocks)
+            s->nclusters = s->nblocks;
+        if (s->side == NULL)
+            s->hist = (float *)malloc((size_t)s->nblocks * NO_OF_CHARS * sizeof(float));
+        s->labels = (int *)malloc(s->nblocks * sizeof(int));
+        if (s->hist == NULL || s->labels == NULL || pbwtp_kmeans_init(&s->km, s->nclusters, s->nthreads)) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        if (s->side == NULL)
+            run_threads(s, histogram_thread);
+        if (pbwtp_kmeans_fit(&s->km, s->hist, s->nblocks, s->labels) || pack_groups(s, max_size)) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        pthread_mutex_init(&s->lock, NULL);
+        run_threads(s, write_thread);
+        if (s->failed)
+            return -1;
+    }
+    if (length > 0)
+        munmap((void *)s->data, length);
+    s->data = NULL;
+    return 0;
+}
+
+static ssize_t read_full(int fd, unsigned char *p, size_t n)
+{
+    size_t got = 0;
+    ssize_t r;
+
+    while (got < n) {
+        r = read(fd, p + got, n - got);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return -1;
+        if (r == 0)
+            break;
+        got += (size_t)r;
+    }
+    return (ssize_t)got;
+}
+
+/* -s: the input is read in batches of max(4 x num_clusters, nthreads) blocks. k-means runs
+ * on the first batch; a block of a later batch goes to the nearest center, which moves to
+ * the mean of all the blocks it got so far (mini-batch k-means). Blocks are packed as in
+ * pack_groups() and appended to their megablock file before the next batch is read, so
+ * memory holds one batch, the centers and the block positions, and not the input. The
+ * megablocks are numbered in the order they are created. */
+static int stream_split(Split *s, int fd, size_t block_size, size_t max_size)
+{
+    size_t buf_size, used, read_pos = 0, position = 0, cut;
+    size_t *all_pos, *all_size, *group_size;
+    int *all_group, *group_of, *group_fd, nall = 0, capacity = 1024, nclusters = s->nclusters;
+    int batch, i, k, g, out, first = 1, eof = 0, rc = 0;
+    unsigned char *buf;
+    char path[MAX_PATH];
+    ssize_t got;
+    unsigned char extra;
+
+    batch = 4 * s->nclusters > s->nthreads ? 4 * s->nclusters : s->nthreads;
+    buf_size = (size_t)batch * (block_size + block_size / 10);
+    buf = (unsigned char *)malloc(buf_size);
+    s->pos = (size_t *)malloc(batch * sizeof(size_t));
+    s->size = (size_t *)malloc(batch * sizeof(size_t));
+    s->hist = (float *)malloc((size_t)batch * NO_OF_CHARS * sizeof(float));
+    s->labels = (int *)malloc(batch * sizeof(int));
+    group_size = (size_t *)calloc(s->nclusters, sizeof(size_t));
+    group_of = (int *)malloc(s->nclusters * sizeof(int));
+    group_fd = (int *)malloc(s->nclusters * sizeof(int));
+    all_pos = (size_t *)malloc(capacity * sizeof(size_t));
+    all_size = (size_t *)malloc(capacity * sizeof(size_t));
+    all_group = (int *)malloc(capacity * sizeof(int));
+    if (buf == NULL || s->pos == NULL || s->size == NULL || s->hist == NULL || s->labels == NULL ||
+        group_size == NULL || group_of == NULL || group_fd == NULL || all_pos == NULL || all_size == NULL ||
+        all_group == NULL || pbwtp_kmeans_init(&s->km, s->nclusters, s->nthreads)) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    for (k = 0; k < s->nclusters; k++)
+        group_fd[k] = -1;
+    s->data = buf;
+
+    while (!eof && !rc) {
+        // next batch, cut as in batch_split(), one after the other in buf
+        for (s->nblocks = 0, used = 0; s->nblocks < batch && !eof; ) {
+            if (s->side && s->side_left == 0) {
+                eof = 1;
+                if (read_full(fd, &extra, 1) != 0) {
+                    fprintf(stderr, "Histogram sidecar does not match the input\n");
+                    return -1;
+                }
+                break;
+            }
+            if (s->side) {
+                if (sidecar_block(s, read_pos, &cut, s->hist + (size_t)s->nblocks * NO_OF_CHARS))
+                    return -1;
+            } else {
+                cut = next_cut(block_size);
+            }
+            if (used + cut > buf_size) {
+                buf_size = (used + cut > 2 * buf_size) ? used + cut : 2 * buf_size;
+                buf = (unsigned char *)realloc(buf, buf_size);
+                if (buf == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    return -1;
+                }
+                s->data = buf;
+            }
+            got = read_full(fd, buf + used, cut);
+            if (got < 0) {
+                perror("read");
+                return -1;
+            }
+            if (s->side && (size_t)got != cut) {
+                fprintf(stderr, "Histogram sidecar does not match the input\n");
+                return -1;
+            }
+            eof = (size_t)got < cut;
+            if (got > 0) {
+                s->pos[s->nblocks] = used;
+                s->size[s->nblocks++] = (size_t)got;
+                used += (size_t)got;
+                read_pos += (size_t)got;
+            }
+        }
+        if (s->nblocks == 0)
+            break;
+        if (s->side == NULL)
+            run_threads(s, histogram_thread);
+
+        if (first ? pbwtp_kmeans_fit(&s->km, s->hist, s->nblocks, s->labels)
+                  : pbwtp_kmeans_update(&s->km, s->hist, s->nblocks, s->labels)) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        // the first batch may have fewer blocks than clusters
+        s->nclusters = s->km.nclusters;
+        first = 0;
+
+        for (i = 0; i < s->nblocks && !rc; i++) {
+            k = s->labels[i];
+            if (group_size[k] + s->size[i] > max_size)
+                for (k = 0; k < s->nclusters && group_size[k] + s->size[i] > max_size; k++);
+            if (k < s->nclusters && group_fd[k] >= 0) {
+                g = group_of[k];
+                out = group_fd[k];
+            } else {
+                // first block of a cluster, or one that fits in none of them
+                g = s->ngroups++;
+                megablock_path(s, g, path);
+                out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                if (out < 0) {
+                    perror(path);
+                    rc = -1;
+                    break;
+                }
+                if (k < s->nclusters) {
+                    group_of[k] = g;
+                    group_fd[k] = out;
+                }
+            }
+            if (write_all(out, s->data + s->pos[i], s->size[i]) || (k == s->nclusters && close(out))) {
+                perror(path);
+                rc = -1;
+            }
+            if (k < s->nclusters)
+                group_size[k] += s->size[i];
+
+            if (nall == capacity) {
+                capacity *= 2;
+                all_pos = (size_t *)realloc(all_pos, capacity * sizeof(size_t));
+                all_size = (size_t *)realloc(all_size, capacity * sizeof(size_t));
+                all_group = (int *)realloc(all_group, capacity * sizeof(int));
+                if (all_pos == NULL || all_size == NULL || all_group == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    return -1;
+                }
+            }
+            all_pos[nall] = position;
+            all_size[nall] = s->size[i];
+            all_group[nall++] = g;
+            position += s->size[i];
+        }
+    }
+    for (k = 0; k < nclusters; k++)
+        if (group_fd[k] >= 0 && close(group_fd[k]))
+            rc = -1;
+
+    free(buf);
+    free(s->pos);
+    free(s->size);
+    free(s->labels);
+    free(group_size);
+    free(group_of);
+    free(group_fd);
+    s->data = NULL;
+    s->pos = all_pos;
+    s->size = all_size;
+    s->labels = all_group;
+    s->nblocks = nall;
+    if (rc)
+        return rc;
+    if (sort_groups(s)) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+//------------------------------------------------------------
+// main command line inputs
+int main(int argc, char *argv[])
+{
+    Split s;
+    struct stat st;
+    size_t block_size, max_size;
+    const char *prog = argv[0], *hist_file = NULL;
+    int fd, opt, stream = 0, rc;
+
+    while ((opt = getopt(argc, argv, "sH:")) != -1) {
+        if (opt == 's')
+            stream = 1;
+        else if (opt == 'H')
+            hist_file = optarg;
+        else
+            argc = 0;
+    }
+    // the positional arguments from argv[1] on
+    argv += optind - 1;
+    argc -= optind - 1;
+    if (argc != 6 && argc != 7) {
+        printf("Usage: %s [-s] [-H histfile] <input_file> <output_dir> <block_size_str> <num_clusters> <max_megablock_size_str> [nthreads]\n"
+               "  -s: streaming, mini-batch k-means with the megablocks written while the input is read\n"
+               "  -H: blocks and histograms from the sidecar of exbwtap2 -H, one block per BWT block\n", prog);
+        return 1;
+    }
+    memset(&s, 0, sizeof(s));
+    block_size = convert_to_bytes(argv[3]);
+    s.nclusters = atoi(argv[4]);
+    max_size = convert_to_bytes(argv[5]);
+    s.nthreads = (argc == 7) ? atoi(argv[6]) : detect_nthreads();
+    if (s.nthreads < 1)
+        s.nthreads = 1;
+    if (s.nthreads > MAX_THREADS)
+        s.nthreads = MAX_THREADS;
+    s.output_dir = argv[2];
+    if (block_size == 0 || s.nclusters < 1) {
+        fprintf(stderr, "block_size and num_clusters must be positive\n");
+        return 1;
+    }
+    if (mkdir(s.output_dir, 0755) && errno != EEXIST) {
+        perror(s.output_dir);
+        return 1;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (hist_file != NULL && open_sidecar(&s, hist_file))
+        return 1;
+    if (stream)
+        rc = stream_split(&s, fd, block_size, max_size);
+    else
+        rc = batch_split(&s, fd, (size_t)st.st_size, block_size, max_size);
+    if (rc)
+        return 1;
+    if (write_metadata(&s)) {
+        fprintf(stderr, "Cannot write metadata.json to %s\n", s.output_dir);
+        return 1;
+    }
+    printf("Total Megablocks Created: %d\n", s.ngroups);
+    printf("Forward processing complete.\n");
+
+    close(fd);
+    if (s.side)
+        fclose(s.side);
+    free(s.pos);
+    free(s.size);
+    free(s.hist);
+    pbwtp_kmeans_free(&s.km);
+    free(s.labels);
+    free(s.order);
+    free(s.group_start);
+    return 0;
+}
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Checks pbwtp -x on a folder made by parallel_compress.pl (sampled BWT records of
+# exbwtap2 -k, megablocks of whole BWT blocks) against the same bytes of the input.
+# Run ./compile.sh first; needs the temp/ subdirectories of the README.
+# usage: ./test_extract.sh infile [blsize]
+
+infile=${1:?usage: ./test_extract.sh infile [blsize]}
+blsize=${2:-256KB}
+out=temp/test_extract_cmp
+fail=0
+
+rm -rf $out
+./parallel_compress.pl $infile $out/ $blsize 8 4MB 2 > /dev/null 2>&1
+size=$(stat -c%s $infile)
+# start of the input, across blocks, past the end
+for range in "0 1000" "$((size / 3)) 600000" "$((size - 5000)) 10000"; do
+    set -- $range
+    n=$2
+    [ $(($1 + n)) -gt $size ] && n=$((size - $1))
+    if ./pbwtp -x $out temp/test_extract.out $blsize $1 $2 2 > /dev/null &&
+       cmp -s temp/test_extract.out <(tail -c +$(($1 + 1)) $infile | head -c $n); then
+        echo "ok: -x $1 $2"
+    else
+        echo "FAILED: -x $1 $2"
+        fail=1
+    fi
+done
+rm -rf $out temp/test_extract.out
+exit $fail
@@ -1,11 +1,77 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libpbwtp.h"
 
 /* Computes and writes the Inverse Burrows-Wheeler Transform */
+/* The block headers are scanned first (each stores its length), then the blocks are
+   inverted concurrently and written with pwrite at their offset in the output. */
+/* Each block is walked from both ends at once (the forward transformation vector from
+   first, its inverse from last), with the symbol packed next to the next index in one
+   32-bit word, and a thread walks up to WALK_BLOCKS blocks interleaved, so that the
+   cache misses of up to 2 x WALK_BLOCKS independent walks overlap. A block takes
+   9 x block_size bytes (5 x with samples, no inverse vector), and the blocks walked
+   together by a thread are limited to WALK_MEMORY bytes and to its share of the blocks. */
+/* Records written with exbwtap2 -k start with the negated length and k sampled
+   (position, row) pairs. Their blocks are walked forward from each sample instead, and
+   when there are fewer blocks than threads the walks of one block are shared among all
+   threads, so a single large block is no longer inverted on one core. */
+/* With -m metadata.json the input is a single decoded megablock made of whole block
+   records ("bwt_blocks": 1, splitf_in_mblocks2 -H or pbwtp -c). Its blocks are written at
+   their offsets in the original, found from the record positions of the metadata, into an
+   output shared with the other megablocks, so the BWT output is never put back together. */
+/* The packed words hold 24 bit indices. Block sizes from PACKED_LIMIT on (exbwtap2 -e psort
+   with large blocks) use plain index vectors instead, the symbols being read from the last
+   column of the input, as libpbwtp does; the walks are the same. */
 
-#define MAX_BLOCK_SIZE 8388608  // Maximum block size for N 
+#define MAX_BLOCK_SIZE 1073741824  // Maximum block size for N 
+#define MAX_THREADS 8
+#define WALK_BLOCKS 4
+#define WALK_MEMORY (64 << 20)  // per thread, for the blocks it walks interleaved
+#define PACKED_LIMIT (1 << 24)  // block records from this length on use unpacked vectors
+
+// A block record of the input: length, [samples,] last column, first, last
+typedef struct {
+    size_t offset;       // of the last column in the input
+    long buflen;
+    unsigned long first, last;
+    size_t out_offset;   // of the decoded block in the output
+    const unsigned char *samples;  // nsamples (position, row) pairs
+    long nsamples;
+} BlockInfo;
+
+// Blocks to invert, pulled by the worker threads
+typedef struct {
+    const unsigned char *input;
+    BlockInfo *blocks;
+    int nblocks;
+    int next;
+    int nthreads;
+    int max_walks;       // walks of one block
+    int walk_blocks;     // blocks a thread walks interleaved, at most WALK_BLOCKS
+    size_t block_size;
+    int packed;          // block_size + 1 < PACKED_LIMIT: symbols packed in the vectors
+    int out_fd;
+    int failed;
+    pthread_mutex_t lock;
+} WorkQueue;
+
+// One walk over a packed transformation vector, writing out[j], out[j + step], ...
+typedef struct {
+    const unsigned int *W;
+    const unsigned char *L;  // symbols of an unpacked W, NULL if W is packed
+    unsigned int i;
+    unsigned char *out;
+    long j, step;
+    size_t left;
+} Walk;
 
 // Function to convert block size from a string to bytes
 size_t convert_to_bytes(const char *size_str) {
@@ -37,15 +103,354 @@ size_t convert_to_bytes(const char *size_str) {
     return (size_t)round(number);  // If no unit is specified, assume it's just bytes
 }
 
+int detect_nthreads(void) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    return (ncpu > 0) ? (int)ncpu : MAX_THREADS;
+}
+
+/* Builds the packed transformation vector W[i] = (T[i] << 8) | buffer[i] of a block and,
+   unless V is NULL, its inverse V[i] = (T^-1[i] << 8) | buffer[i]; unless packed, just
+   W[i] = T[i] and V[i] = T^-1[i]. */
+void build_vectors(const unsigned char *buffer, const BlockInfo *b, unsigned int *W, unsigned int *V, int packed) {
+    unsigned int Count[257], RunningTotal[257];
+    unsigned int buflen = (unsigned int)b->buflen;
+
+    // Initialize the Count array
+    for (unsigned int i = 0; i < 257; i++) {
+        Count[i] = 0;
+    }
+
+    // Count the occurrences of each byte
+    for (unsigned int i = 0; i < buflen; i++) {
+        unsigned int index = (i == b->last) ? 256 : buffer[i];
+        Count[index]++;
+    }
+
+    // Create the RunningTotal array
+    unsigned int sum = 0;
+    for (unsigned int i = 0; i < 257; i++) {
+        RunningTotal[i] = sum;
+        sum += Count[i];
+        Count[i] = 0;  // Reset Count array for reuse
+    }
+
+    // Populate the transformation vector and its inverse
+    for (unsigned int i = 0; i < buflen; i++) {
+        unsigned int index = (i == b->last) ? 256 : buffer[i];
+        unsigned int k = RunningTotal[index] + Count[index];
+        W[k] = i;
+        if (V)
+            V[i] = packed ? (k << 8) | buffer[i] : k;
+        Count[index]++;
+    }
+    for (unsigned int i = 0; packed && i < buflen; i++) {
+        W[i] = (W[i] << 8) | buffer[i];
+    }
+}
+
+/* Checks that the sampled positions are in order within the block and the rows exist. */
+int valid_samples(const unsigned char *samples, long nsamples, long buflen) {
+    long pos, row, prev = 0;
+
+    for (long m = 0; m < nsamples; m++) {
+        memcpy(&pos, samples + 2 * m * sizeof(long), sizeof(long));
+        memcpy(&row, samples + (2 * m + 1) * sizeof(long), sizeof(long));
+        if (pos < prev || pos > buflen - 1 || row < 0 || row >= buflen)
+            return 0;
+        prev = pos;
+    }
+    return 1;
+}
+
+void set_walk(Walk *w, const unsigned int *W, const unsigned char *L, unsigned int i, unsigned char *out,
+              long j, long step, size_t left) {
+    w->W = W;
+    w->L = L;
+    w->i = i;
+    w->out = out;
+    w->j = j;
+    w->step = step;
+    w->left = left;
+}
+
+/* Sets up the walks producing out[0..buflen-2]: forward from first and from every sample
+   up to the next one, or without samples the first half forward from first and the
+   second half backward from the row before the end marker. L is the last column for
+   unpacked vectors, NULL for packed ones. Returns the number of walks. */
+int add_walks(const BlockInfo *b, const unsigned int *W, const unsigned int *V, const unsigned char *L,
+              unsigned char *out, Walk *walks) {
+    size_t n = (size_t)(b->buflen - 1);
+    int nw = 0;
+
+    if (b->nsamples > 0) {
+        long start = 0, pos, row;
+        unsigned long from = b->first;
+        for (long m = 0; m <= b->nsamples; m++) {
+            if (m < b->nsamples) {
+                memcpy(&pos, b->samples + 2 * m * sizeof(long), sizeof(long));
+                memcpy(&row, b->samples + (2 * m + 1) * sizeof(long), sizeof(long));
+            } else {
+                pos = (long)n;
+                row = 0;
+            }
+            if (pos > start)
+                set_walk(&walks[nw++], W, L, (unsigned int)from, out, start, 1, pos - start);
+            start = pos;
+            from = row;
+        }
+        return nw;
+    }
+
+    size_t half = (b->last < (unsigned long)b->buflen) ? n / 2 : 0;  // no marker, forward only
+    if (n - half > 0)
+        set_walk(&walks[nw++], W, L, (unsigned int)b->first, out, 0, 1, n - half);
+    if (half > 0)
+        set_walk(&walks[nw++], V, L, L ? V[b->last] : V[b->last] >> 8, out, (long)n - 1, -1, half);
+    return nw;
+}
+
+/* Runs the walks interleaved, prefetching the next word of each walk. The walks are all
+   packed or all unpacked. */
+void run_walks(Walk *walks, int nw) {
+    while (nw > 0) {
+        size_t steps = walks[0].left;
+        for (int k = 1; k < nw; k++)
+            if (walks[k].left < steps)
+                steps = walks[k].left;
+
+        if (walks[0].L) {
+            for (size_t s = 0; s < steps; s++) {
+                for (int k = 0; k < nw; k++) {
+                    Walk *w = &walks[k];
+                    w->out[w->j] = w->L[w->i];
+                    w->j += w->step;
+                    w->i = w->W[w->i];
+                    __builtin_prefetch(&w->W[w->i]);
+                    __builtin_prefetch(&w->L[w->i]);
+                }
+            }
+        } else {
+            for (size_t s = 0; s < steps; s++) {
+                for (int k = 0; k < nw; k++) {
+                    Walk *w = &walks[k];
+                    unsigned int v = w->W[w->i];
+                    w->out[w->j] = (unsigned char)v;
+                    w->j += w->step;
+                    w->i = v >> 8;
+                    __builtin_prefetch(&w->W[w->i]);
+                }
+            }
+        }
+
+        // drop the finished walks
+        for (int k = 0; k < nw; ) {
+            walks[k].left -= steps;
+            if (walks[k].left == 0)
+                walks[k] = walks[--nw];
+            else
+                k++;
+        }
+    }
+}
+
+void *ibwt_worker(void *arg) {
+    WorkQueue *q = (WorkQueue *)arg;
+    unsigned int *W[WALK_BLOCKS] = { NULL }, *V[WALK_BLOCKS] = { NULL };
+    unsigned char *out[WALK_BLOCKS] = { NULL };
+    Walk *walks = (Walk *)malloc(WALK_BLOCKS * q->max_walks * sizeof(Walk));
+
+    if (!walks) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(1);
+    }
+
+    for (;;) {
+        // take a share of the remaining blocks, at most walk_blocks
+        pthread_mutex_lock(&q->lock);
+        int nb0 = q->next;
+        int take = (q->nblocks - nb0 + q->nthreads - 1) / q->nthreads;
+        if (take > q->walk_blocks)
+            take = q->walk_blocks;
+        q->next += take;
+        pthread_mutex_unlock(&q->lock);
+        if (take <= 0)
+            break;
+
+        int nw = 0;
+        for (int g = 0; g < take; g++) {
+            BlockInfo *b = &q->blocks[nb0 + g];
+            if (!out[g]) {
+                W[g] = (unsigned int *)malloc((q->block_size + 2) * sizeof(unsigned int));
+                out[g] = (unsigned char *)malloc(q->block_size + 2);
+                if (!W[g] || !out[g]) {
+                    fprintf(stderr, "Memory allocation failed.\n");
+                    exit(1);
+                }
+            }
+            // the inverse vector only for the blocks walked from both ends
+            if (!b->nsamples && !V[g]) {
+                V[g] = (unsigned int *)malloc((q->block_size + 2) * sizeof(unsigned int));
+                if (!V[g]) {
+                    fprintf(stderr, "Memory allocation failed.\n");
+                    exit(1);
+                }
+            }
+            const unsigned char *L = q->input + b->offset;
+            build_vectors(L, b, W[g], b->nsamples ? NULL : V[g], q->packed);
+            nw += add_walks(b, W[g], V[g], q->packed ? NULL : L, out[g], &walks[nw]);
+        }
+        run_walks(walks, nw);
+
+        for (int g = 0; g < take; g++) {
+            BlockInfo *b = &q->blocks[nb0 + g];
+            size_t len = (size_t)(b->buflen - 1);
+            if (len > 0 && pwrite(q->out_fd, out[g], len, b->out_offset) != (ssize_t)len) {
+                fprintf(stderr, "Error writing block %d to output file.\n", nb0 + g);
+                pthread_mutex_lock(&q->lock);
+                q->failed = 1;
+                pthread_mutex_unlock(&q->lock);
+            }
+        }
+    }
+
+    for (int g = 0; g < WALK_BLOCKS; g++) {
+        free(W[g]);
+        free(V[g]);
+        free(out[g]);
+    }
+    free(walks);
+    return NULL;
+}
+
+// The share of the walks of one block run by one thread
+typedef struct {
+    Walk *walks;
+    int nwalks;
+} WalkShare;
+
+void *walk_worker(void *arg) {
+    WalkShare *ws = (WalkShare *)arg;
+    run_walks(ws->walks, ws->nwalks);
+    return NULL;
+}
+
+/* Inverts the blocks one at a time, each by all threads over its sampled walks. */
+int invert_blocks_shared(WorkQueue *q, int nthreads) {
+    unsigned int *W = (unsigned int *)malloc((q->block_size + 2) * sizeof(unsigned int));
+    unsigned int *V = (unsigned int *)malloc((q->block_size + 2) * sizeof(unsigned int));
+    unsigned char *out = (unsigned char *)malloc(q->block_size + 2);
+    Walk *walks = (Walk *)malloc(q->max_walks * sizeof(Walk));
+    Walk *split = (Walk *)malloc(q->max_walks * sizeof(Walk));
+    pthread_t threads[nthreads];
+    WalkShare shares[nthreads];
+
+    if (!W || !V || !out || !walks || !split) {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(1);
+    }
+    for (int nb = 0; nb < q->nblocks; nb++) {
+        BlockInfo *b = &q->blocks[nb];
+        size_t len = (size_t)(b->buflen - 1);
+
+        const unsigned char *L = q->input + b->offset;
+        build_vectors(L, b, W, b->nsamples ? NULL : V, q->packed);
+        int nw = add_walks(b, W, V, q->packed ? NULL : L, out, walks);
+        int nt = (nthreads < nw) ? nthreads : nw;
+
+        // thread t runs walks t, t + nt, ... so every thread gets parts of the whole block
+        for (int t = 0, k = 0; t < nt; t++) {
+            shares[t].walks = split + k;
+            for (int w = t; w < nw; w += nt)
+                split[k++] = walks[w];
+            shares[t].nwalks = (int)(split + k - shares[t].walks);
+            if (pthread_create(&threads[t], NULL, walk_worker, &shares[t])) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for (int t = 0; t < nt; t++)
+            pthread_join(threads[t], NULL);
+
+        if (len > 0 && pwrite(q->out_fd, out, len, b->out_offset) != (ssize_t)len) {
+            fprintf(stderr, "Error writing block %d to output file.\n", nb);
+            pthread_mutex_lock(&q->lock);
+            q->failed = 1;
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+    free(W);
+    free(V);
+    free(out);
+    free(walks);
+    free(split);
+    pthread_mutex_lock(&q->lock);
+    int failed = q->failed;
+    pthread_mutex_unlock(&q->lock);
+    return failed;
+}
+
+/* Sets the output offsets of the blocks of megablock input_file with -m: the record at
+   position p of the BWT output is block p / record size, every record but the last one
+   being full. Checks that the input holds exactly the records listed in the metadata. */
+int place_megablock(const char *meta_file, const char *input_file, BlockInfo *blocks, int nblocks,
+                    size_t scanned, size_t input_size, size_t block_size) {
+    pbwtp_metadata meta;
+    const pbwtp_megablock *mb = NULL;
+    const char *name = strrchr(input_file, '/'), *mb_name;
+    size_t start = 0, header, record;
+    int rc = -1;
+
+    name = name ? name + 1 : input_file;
+    if (pbwtp_meta_read(meta_file, &meta)) {
+        fprintf(stderr, "Error reading %s\n", meta_file);
+        return -1;
+    }
+    for (int i = 0; i < meta.nmegablocks && mb == NULL; i++) {
+        mb_name = strrchr(meta.megablocks[i].file, '/');
+        mb_name = mb_name ? mb_name + 1 : meta.megablocks[i].file;
+        if (strcmp(mb_name, name) == 0)
+            mb = &meta.megablocks[i];
+    }
+    if (!meta.bwt_blocks || mb == NULL || mb->nblocks != nblocks || scanned != input_size) {
+        fprintf(stderr, "%s is not a megablock of whole BWT blocks of %s\n", input_file, meta_file);
+        goto done;
+    }
+    for (int j = 0; j < nblocks; j++) {
+        header = sizeof(long) + (blocks[j].nsamples ? (1 + 2 * blocks[j].nsamples) * sizeof(long) : 0);
+        record = header + block_size + 1 + 2 * sizeof(long);
+        if (blocks[j].offset != start + header || mb->blocks[j].position % record != 0 ||
+            mb->blocks[j].size != header + blocks[j].buflen + 2 * sizeof(long)) {
+            fprintf(stderr, "Block %d of %s does not match %s\n", j, input_file, meta_file);
+            goto done;
+        }
+        blocks[j].out_offset = mb->blocks[j].position / record * block_size;
+        start += mb->blocks[j].size;
+    }
+    rc = 0;
+done:
+    pbwtp_meta_free(&meta);
+    return rc;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s input_file output_file block_size_str\n", argv[0]);
+    const char *meta_file = NULL;
+
+    if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+        meta_file = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "Usage: %s [-m metadata.json] input_file output_file block_size_str [nthreads]\n", argv[0]);
         return 1;
     }
 
     const char* input_file = argv[1];
     const char* output_file = argv[2];
     size_t block_size = convert_to_bytes(argv[3]);
+    int nthreads = (argc == 5) ? atoi(argv[4]) : 0;
+    if (nthreads <= 0)
+        nthreads = detect_nthreads();
 
     // Increase the block size to accommodate N+1 characters
     if (block_size > MAX_BLOCK_SIZE) {
@@ -53,93 +458,151 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    // Open the input and output files
-    FILE *in_file = fopen(input_file, "rb");
-    if (!in_file) {
+    // Map the input file
+    int in_fd = open(input_file, O_RDONLY);
+    struct stat st;
+    if (in_fd < 0 || fstat(in_fd, &st) != 0) {
         fprintf(stderr, "Error opening input file: %s\n", input_file);
         return 1;
     }
+    size_t input_size = st.st_size;
+    const unsigned char *input = NULL;
+    if (input_size > 0) {
+        input = (const unsigned char *)mmap(NULL, input_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+        if (input == MAP_FAILED) {
+            fprintf(stderr, "Error reading input file: %s\n", input_file);
+            return 1;
+        }
+        madvise((void *)input, input_size, MADV_SEQUENTIAL);
+    }
 
-    FILE *out_file = fopen(output_file, "wb");
-    if (!out_file) {
-        fclose(in_file);
+    // with -m the output is shared by the decoders of all megablocks
+    int out_fd = open(output_file, O_WRONLY | O_CREAT | (meta_file ? 0 : O_TRUNC), 0644);
+    if (out_fd < 0) {
         fprintf(stderr, "Error opening output file: %s\n", output_file);
         return 1;
     }
 
-    long buflen;
+    // Scan the block headers; the blocks before a bad header are still decoded
+    BlockInfo *blocks = NULL;
+    int nblocks = 0, capacity = 0, unsampled = 0;
+    size_t pos = 0, out_size = 0;
+    long buflen, nsamples, max_samples = 0;
     unsigned long first, last;
+    const unsigned char *samples;
 
-    // Dynamically allocate memory for block processing
-    // Allocate space for N+1 characters (hence block_size + 1)
-    unsigned char* buffer = (unsigned char*) malloc(block_size + 2);  // +2 for safety
-    unsigned int* T = (unsigned int*) malloc((block_size + 2) * sizeof(unsigned int));
-    unsigned int* Count = (unsigned int*) malloc(257 * sizeof(unsigned int));
-    unsigned int* RunningTotal = (unsigned int*) malloc(257 * sizeof(unsigned int));
-
-    if (!buffer || !T || !Count || !RunningTotal) {
-        fprintf(stderr, "Memory allocation failed.\n");
-        exit(1);
-    }
-
-    // Process each block in the input file sequentially
-    while (fread(&buflen, sizeof(buflen), 1, in_file) == 1) {
-        if (buflen > block_size + 1) {  // Allow buflen to be block_size + 1
+    while (input_size - pos >= sizeof(buflen)) {
+        memcpy(&buflen, input + pos, sizeof(buflen));
+        pos += sizeof(buflen);
+        nsamples = 0;
+        samples = NULL;
+        if (buflen < 0 && input_size - pos >= sizeof(nsamples)) {
+            // record with start samples
+            buflen = -buflen;
+            memcpy(&nsamples, input + pos, sizeof(nsamples));
+            pos += sizeof(nsamples);
+            if (nsamples < 0 || (size_t)nsamples > (input_size - pos) / (2 * sizeof(long))
+                || !valid_samples(input + pos, nsamples, buflen)) {
+                fprintf(stderr, "Invalid samples in block %d.\n", nblocks);
+                break;
+            }
+            samples = input + pos;
+            pos += 2 * nsamples * sizeof(long);
+        }
+        if (buflen < 1 || (size_t)buflen > block_size + 1) {  // Allow buflen to be block_size + 1
             fprintf(stderr, "Buffer overflow detected! Buflen: %ld, Block size: %zu\n", buflen, block_size + 1);
             break;
         }
-
-        // Read the block data
-        if (fread(buffer, 1, buflen, in_file) != (size_t)buflen) {
+        if (input_size - pos < (size_t)buflen + sizeof(first) + sizeof(last)) {
             fprintf(stderr, "Error reading buffer from input file.\n");
             break;
         }
-
-        // Read the first and last index
-        fread(&first, sizeof(first), 1, in_file);
-        fread(&last, sizeof(last), 1, in_file);
-
-        // Initialize the Count array
-        for (unsigned int i = 0; i < 257; i++) {
-            Count[i] = 0;
+        memcpy(&first, input + pos + buflen, sizeof(first));
+        memcpy(&last, input + pos + buflen + sizeof(first), sizeof(last));
+        if (first >= (unsigned long)buflen) {
+            fprintf(stderr, "Invalid first index %lu in block %d.\n", first, nblocks);
+            break;
         }
 
-        // Count the occurrences of each byte
-        for (unsigned int i = 0; i < (unsigned int)buflen; i++) {
-            unsigned int index = (i == last) ? 256 : buffer[i];
-            Count[index]++;
+        if (nblocks == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            blocks = (BlockInfo *)realloc(blocks, capacity * sizeof(BlockInfo));
+            if (!blocks) {
+                fprintf(stderr, "Memory allocation failed.\n");
+                exit(1);
+            }
         }
+        blocks[nblocks].offset = pos;
+        blocks[nblocks].buflen = buflen;
+        blocks[nblocks].first = first;
+        blocks[nblocks].last = last;
+        blocks[nblocks].out_offset = out_size;
+        blocks[nblocks].samples = samples;
+        blocks[nblocks].nsamples = nsamples;
+        if (nsamples > max_samples)
+            max_samples = nsamples;
+        if (nsamples == 0)
+            unsampled = 1;
+        nblocks++;
+        pos += buflen + sizeof(first) + sizeof(last);
+        out_size += buflen - 1;
+    }
 
-        // Create the RunningTotal array
-        unsigned int sum = 0;
-        for (unsigned int i = 0; i < 257; i++) {
-            RunningTotal[i] = sum;
-            sum += Count[i];
-            Count[i] = 0;  // Reset Count array for reuse
-        }
+    // Invert the blocks concurrently, each written at its offset
+    if (meta_file) {
+        if (place_megablock(meta_file, input_file, blocks, nblocks, pos, input_size, block_size))
+            return 1;
+    } else if (out_size > 0 && ftruncate(out_fd, out_size) != 0) {
+        fprintf(stderr, "Error resizing output file: %s\n", output_file);
+        return 1;
+    }
+    // with samples and fewer blocks than threads, all threads work on one block at a time
+    int shared = (max_samples > 0 && nblocks < nthreads);
+    if (nthreads > nblocks && !shared)
+        nthreads = (nblocks > 0) ? nblocks : 1;
 
-        // Populate the transformation vector T
-        for (unsigned int i = 0; i < (unsigned int)buflen; i++) {
-            unsigned int index = (i == last) ? 256 : buffer[i];
-            T[RunningTotal[index] + Count[index]] = i;
-            Count[index]++;
-        }
+    WorkQueue queue;
+    queue.input = input;
+    queue.blocks = blocks;
+    queue.nblocks = nblocks;
+    queue.next = 0;
+    queue.nthreads = nthreads;
+    queue.max_walks = (max_samples + 1 > 2) ? (int)max_samples + 1 : 2;
+    queue.block_size = block_size;
+    queue.packed = (block_size + 1 < PACKED_LIMIT);
+    size_t block_memory = (block_size + 2) * (unsampled ? 9 : 5);
+    queue.walk_blocks = (int)(WALK_MEMORY / block_memory);
+    if (queue.walk_blocks > WALK_BLOCKS)
+        queue.walk_blocks = WALK_BLOCKS;
+    if (queue.walk_blocks < 1)
+        queue.walk_blocks = 1;
+    queue.out_fd = out_fd;
+    queue.failed = 0;
+    pthread_mutex_init(&queue.lock, NULL);
 
-        // Write the output by following the T array
-        unsigned int i = first;
-        for (unsigned int j = 0; j < (unsigned int)(buflen - 1); j++) {
-            putc(buffer[i], out_file);
-            i = T[i];  // Follow the transformation vector
-        }
+    if (shared) {
+        invert_blocks_shared(&queue, nthreads);
+    } else {
+        pthread_t threads[nthreads];
+        for (int t = 0; t < nthreads; t++)
+            if (pthread_create(&threads[t], NULL, ibwt_worker, &queue)) {
+                perror("pthread_create");
+                exit(1);
+            }
+        for (int t = 0; t < nthreads; t++)
+            pthread_join(threads[t], NULL);
     }
+    pthread_mutex_lock(&queue.lock);
+    int failed = queue.failed;
+    pthread_mutex_unlock(&queue.lock);
+    pthread_mutex_destroy(&queue.lock);
 
     // Free dynamically allocated memory
-    free(buffer);
-    free(T);
-    free(Count);
-    free(RunningTotal);
-
-    fclose(in_file);
-    fclose(out_file);
-    return 0;
+    free(blocks);
+    if (input_size > 0)
+        munmap((void *)input, input_size);
+    close(in_fd);
+    if (close(out_fd) != 0)
+        failed = 1;
+    return failed;
 }